@@ -1,36 +1,425 @@
 #include "jpg.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
 
-void readStartOfScan (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading SOS marker\n";
+//x86 builds carry the SSE2, SSSE3 and AVX2 kernels side by side and pick one of each at startup.
+//the wider ones are compiled for their instruction set on their own, the rest of the build stays SSE2
+#define JPG_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+//messages of the decoder go to logSink, the ones past logLevel aren't even formatted
+LogLevel logLevel = LogLevel::Error;
+LogSink logSink = [](const LogLevel, const std::string& message) {
+    std::cout << message << "\n";
+};
+
+//pick what gets reported and where, an empty sink keeps the current one
+void setLogging(const LogLevel level, const LogSink& sink = LogSink()) {
+    logLevel = level;
+    if (sink) {
+        logSink = sink;
+    }
+}
+
+#define JPG_LOG(level, message) do { \
+    if ((level) <= logLevel) { \
+        std::ostringstream logMessage; \
+        logMessage << message; \
+        logSink(level, logMessage.str()); \
+    } \
+} while (0)
+
+
+//the IDCT and color conversion go through this table, setSIMDLevel fills it in before main runs
+Kernels kernels;
+
+
+//with -DJPG_STATS every thread counts into its own DecodeStats, JPG_COUNT adds to a counter and
+//JPG_TIME adds the time until the end of the enclosing scope to a stage. both compile to nothing otherwise
+#if defined(JPG_STATS)
+
+thread_local DecodeStats threadStats;
+
+void addStats(DecodeStats& to, const DecodeStats& from) {
+    to.bitsConsumed += from.bitsConsumed;
+    to.bytesUnstuffed += from.bytesUnstuffed;
+    to.huffmanSlowPath += from.huffmanSlowPath;
+    to.restartIntervals += from.restartIntervals;
+    to.blocks += from.blocks;
+    to.dcOnlyBlocks += from.dcOnlyBlocks;
+    to.sparseBlocks += from.sparseBlocks;
+    to.parseSeconds += from.parseSeconds;
+    to.entropySeconds += from.entropySeconds;
+    to.idctSeconds += from.idctSeconds;
+    to.colorSeconds += from.colorSeconds;
+    to.outputSeconds += from.outputSeconds;
+}
+
+class StageTimer {
+    private:
+        double& seconds;
+        const std::chrono::steady_clock::time_point start;
+    public:
+        StageTimer(double& stageSeconds) : seconds(stageSeconds), start(std::chrono::steady_clock::now()) {}
+        ~StageTimer() {
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+};
+
+#define JPG_COUNT(counter, n) (threadStats.counter += (n))
+#define JPG_TIME(stage) StageTimer stageTimer(threadStats.stage)
+
+//continue counting on this thread from stats
+void startStats(const DecodeStats& stats = DecodeStats()) {
+    threadStats = stats;
+}
+
+DecodeStats currentStats() {
+    return threadStats;
+}
+
+#else
+
+#define JPG_COUNT(counter, n)
+#define JPG_TIME(stage)
+
+void startStats(const DecodeStats& = DecodeStats()) {}
+
+DecodeStats currentStats() {
+    return DecodeStats();
+}
+
+#endif
+
+
+//read-only view of a whole file, memory-mapped where the platform supports it
+class MappedFile {
+    private:
+        const byte* mapping = nullptr;
+        std::size_t length = 0;
+        bool open = false;
+#if defined(_WIN32)
+        std::vector<byte> contents;
+#endif
+    public:
+        MappedFile(const std::string& filename) {
+#if defined(_WIN32)
+            std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary | std::ios::ate);
+            if (!inFile.is_open()) {
+                return;
+            }
+            contents.resize((std::size_t)inFile.tellg());
+            inFile.seekg(0);
+            inFile.read((char*)contents.data(), contents.size());
+            mapping = contents.data();
+            length = contents.size();
+            open = true;
+#else
+            const int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                return;
+            }
+            length = info.st_size;
+            //mmap rejects empty files, leave those as a zero length view
+            if (length != 0) {
+                void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    ::close(fd);
+                    return;
+                }
+                madvise(address, length, MADV_SEQUENTIAL);
+                mapping = (const byte*)address;
+            }
+            ::close(fd);
+            open = true;
+#endif
+        }
+
+        ~MappedFile() {
+#if !defined(_WIN32)
+            if (mapping != nullptr) {
+                munmap((void*)mapping, length);
+            }
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool isOpen() const { return open; }
+        const byte* data() const { return mapping; }
+        std::size_t size() const { return length; }
+};
+
+
+//output file of a size known up front, written in place through a shared memory mapping where the platform
+//supports it. a new file reads as zeros until written. regions given to release are final: they are left to
+//the kernel to write back and dropped from the process, so the resident memory doesn't grow with the file.
+//a file that fails to be created or is never closed is removed again, so a failed decode leaves nothing behind
+class MappedOutputFile {
+    private:
+        std::string filename;
+        byte* mapping = nullptr;
+        std::size_t length = 0;
+        bool open = false;
+        bool failed = false;
+#if defined(_WIN32)
+        std::ofstream outFile;
+#else
+        int fd = -1;
+#endif
+
+        //unmap and close, true when everything written so far has been handed to the system
+        bool unmap() {
+#if defined(_WIN32)
+            if (outFile.is_open()) {
+                outFile.close();
+                failed = failed || outFile.fail();
+            }
+#else
+            if (mapping != nullptr) {
+                failed = msync(mapping, length, MS_ASYNC) != 0 || failed;
+                failed = munmap(mapping, length) != 0 || failed;
+                mapping = nullptr;
+            }
+            if (fd >= 0) {
+                failed = ::close(fd) != 0 || failed;
+                fd = -1;
+            }
+#endif
+            return !failed;
+        }
+
+        void discard() {
+            unmap();
+            if (open) {
+                std::error_code error;
+                std::filesystem::remove(filename, error);
+                open = false;
+            }
+            failed = true;
+        }
+    public:
+        MappedOutputFile() {}
+        MappedOutputFile(const MappedOutputFile&) = delete;
+        MappedOutputFile& operator=(const MappedOutputFile&) = delete;
+
+        bool create(const std::string& outFilename, const std::size_t size) {
+            filename = outFilename;
+            length = size;
+            failed = false;
+#if defined(_WIN32)
+            outFile.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!outFile.is_open()) {
+                failed = true;
+                return false;
+            }
+            open = true;
+            if (size != 0) {
+                outFile.seekp(size - 1);
+                outFile.put(0);
+            }
+            if (!outFile.good()) {
+                discard();
+                return false;
+            }
+            return true;
+#else
+            fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                failed = true;
+                return false;
+            }
+            open = true;
+            if (ftruncate(fd, size) != 0) {
+                discard();
+                return false;
+            }
+            if (size != 0) {
+#if defined(__linux__)
+                //reserve the blocks up front, a full disk fails here instead of faulting on the mapping later
+                //and filling the holes of a sparse file one page fault at a time is slower
+                if (posix_fallocate(fd, 0, size) != 0) {
+                    discard();
+                    return false;
+                }
+#endif
+                void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (address == MAP_FAILED) {
+                    discard();
+                    return false;
+                }
+                mapping = (byte*)address;
+            }
+            return true;
+#endif
+        }
+
+        //false once anything went wrong with the file
+        bool good() const {
+            return !failed;
+        }
+
+        void write(const std::size_t offset, const byte* const bytes, const std::size_t size) {
+            if (failed) {
+                return;
+            }
+#if defined(_WIN32)
+            outFile.seekp(offset);
+            outFile.write((const char*)bytes, size);
+            failed = !outFile.good();
+#else
+            std::memcpy(mapping + offset, bytes, size);
+#endif
+        }
+
+        void release(const std::size_t begin, const std::size_t end) {
+#if !defined(_WIN32)
+            //only whole pages inside the region
+            const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+            const std::size_t first = (begin + pageSize - 1) / pageSize * pageSize;
+            const std::size_t last = end / pageSize * pageSize;
+            if (!failed && first < last) {
+                //start the write back of the region before dropping it
+                failed = msync(mapping + first, last - first, MS_ASYNC) != 0;
+                madvise(mapping + first, last - first, MADV_DONTNEED);
+            }
+#endif
+        }
+
+        //finish the file, it is removed again when anything went wrong
+        bool close() {
+            if (!open) {
+                return false;
+            }
+            if (!unmap()) {
+                discard();
+                return false;
+            }
+            open = false;
+            return true;
+        }
+
+        ~MappedOutputFile() {
+            discard();
+        }
+};
+
+
+//helper class to read bytes and skip segments within a span of memory
+class ByteReader {
+    private:
+        const byte* data;
+        std::size_t size;
+        std::size_t position = 0;
+    public:
+        ByteReader(const byte* const d, const std::size_t s) : data(d), size(s) {}
+
+        //read one byte, reading past the end returns 0 and marks the reader as ended
+        byte get() {
+            if (position >= size) {
+                position = size + 1;
+                return 0;
+            }
+            return data[position++];
+        }
+
+        //read a big endian 2-byte value
+        uint getShort() {
+            const uint high = get();
+            return (high << 8) | get();
+        }
+
+        //skipping a segment is just a bump of the position
+        void skip(const std::size_t count) {
+            if (position > size || count > size - position) {
+                position = size + 1;
+                return;
+            }
+            position += count;
+        }
+
+        //move to the next occurrence of value, or to the end if there is none
+        void skipUntil(const byte value) {
+            if (position >= size) {
+                return;
+            }
+            const void* found = std::memchr(data + position, value, size - position);
+            position = found == nullptr ? size : (const byte*)found - data;
+        }
+
+        std::size_t tell() const {
+            return position;
+        }
+
+        bool ended() const {
+            return position > size;
+        }
+};
+
+
+
+void readStartOfScan (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading SOS marker");
     if(header->numComponents == 0) {
-        std::cout << "Error - SOS detected before SOF\n";
+        JPG_LOG(LogLevel::Error, "Error - SOS detected before SOF");
         header->valid = false;
         return;
     }
-    uint length = (inFile.get() << 8) + inFile.get();
+    uint length = reader.getShort();
     
     //reset flag
     for(uint i = 0; i < header->numComponents; ++i) {
         header->colorComponents[i].used = false;
     }
 
-    byte numComponentsInScan = inFile.get();
-    if(numComponentsInScan != header->numComponents) {
-        std::cout << "Error - only baseline JPEGs supported\n";
+    Scan scan;
+    byte numComponentsInScan = reader.get();
+    if(numComponentsInScan == 0 || numComponentsInScan > header->numComponents) {
+        JPG_LOG(LogLevel::Error, "Error - invalid number of components in scan");
         header->valid = false;
         return;
     }
+    scan.numComponents = numComponentsInScan;
 
     for(uint i = 0; i < numComponentsInScan; ++i) {
-        byte componentID = inFile.get();
+        byte componentID = reader.get();
         if(header->zeroIndex) {
             componentID += 1;
         }
-        if (componentID > header->numComponents) {
-            std::cout << "Error - invalid component ID\n";
+        if (componentID == 0 || componentID > header->numComponents) {
+            JPG_LOG(LogLevel::Error, "Error - invalid component ID");
             header->valid = false;
             return;
         }
@@ -38,90 +427,173 @@ void readStartOfScan (std::ifstream& inFile, Header* const header) {
         ColorComponent* cmpnt = &header->colorComponents[componentID-1];
 
         if(cmpnt->used) {
-            std::cout << "Error - Duplicate color component\n";
+            JPG_LOG(LogLevel::Error, "Error - Duplicate color component");
             header->valid = false;
             return;
         }
         cmpnt->used = true;
+        scan.componentIndices[i] = componentID - 1;
 
-        byte huffmanTableInfo = inFile.get();
+        byte huffmanTableInfo = reader.get();
         cmpnt->dcHuffmanTableID = huffmanTableInfo >> 4;
         cmpnt->acHuffmanTableID = huffmanTableInfo & 0x0F;
 
         if(cmpnt->dcHuffmanTableID > 3) {
-            std::cout << "Invalid DC Huffman Table ID: " << (uint)cmpnt->dcHuffmanTableID <<"\n";
+            JPG_LOG(LogLevel::Error, "Invalid DC Huffman Table ID: " << (uint)cmpnt->dcHuffmanTableID);
             header->valid = false;
             return;
         }
         if(cmpnt->acHuffmanTableID > 3) {
-            std::cout << "Invalid AC Huffman Table ID: "<< (uint)cmpnt->acHuffmanTableID <<"\n";
+            JPG_LOG(LogLevel::Error, "Invalid AC Huffman Table ID: "<< (uint)cmpnt->acHuffmanTableID);
             header->valid = false;
             return;
         }
     }
-    header->startOfSelection = inFile.get();
-    header->endOfSelection = inFile.get();
-    byte successiveApproximation = inFile.get();
-    header->successiveApproxHigh = successiveApproximation >> 4;
-    header->successiveApproxLow = successiveApproximation & 0x0F;
+    scan.startOfSelection = reader.get();
+    scan.endOfSelection = reader.get();
+    byte successiveApproximation = reader.get();
+    scan.successiveApproxHigh = successiveApproximation >> 4;
+    scan.successiveApproxLow = successiveApproximation & 0x0F;
 
-    //Verify baseline JPEG, they dont use spectral selection or successive approximation
-    if (header->startOfSelection != 0 || header->endOfSelection != 63) {
-        std::cout << "Error - invalid spectral selection\n";
-        header->valid = false;
-        return;
+    if (header->frameType == SOF0) {
+        //baseline JPEGs dont use spectral selection or successive approximation
+        if (scan.startOfSelection != 0 || scan.endOfSelection != 63) {
+            JPG_LOG(LogLevel::Error, "Error - invalid spectral selection");
+            header->valid = false;
+            return;
+        }
+        if (scan.successiveApproxHigh !=0 || scan.successiveApproxLow !=0) {
+            JPG_LOG(LogLevel::Error, "Error - invalid successive approximation value");
+            header->valid = false;
+            return;
+        }
     }
-    if (header->successiveApproxHigh !=0 || header->successiveApproxLow !=0) {
-        std::cout << "Error - invalid successive approximation value\n";
-        header->valid = false;
-        return;
+    else {
+        //progressive scans hold either the DC coefficients or one band of AC coefficients of a single component
+        if (scan.startOfSelection > scan.endOfSelection || scan.endOfSelection > 63 ||
+            (scan.startOfSelection == 0 && scan.endOfSelection != 0) ||
+            (scan.startOfSelection != 0 && numComponentsInScan != 1)) {
+            JPG_LOG(LogLevel::Error, "Error - invalid spectral selection");
+            header->valid = false;
+            return;
+        }
+        //refinement scans add exactly one bit
+        if (scan.successiveApproxLow > 13 ||
+            (scan.successiveApproxHigh != 0 && scan.successiveApproxHigh != scan.successiveApproxLow + 1)) {
+            JPG_LOG(LogLevel::Error, "Error - invalid successive approximation value");
+            header->valid = false;
+            return;
+        }
     }
     if(length - 6 - (2*numComponentsInScan) != 0) {
-        std::cout << "Error - invalid SOS marker\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid SOS marker");
         header->valid = false;
         return;
     }
+
+    //tables may be redefined before the next scan, keep the ones this scan needs
+    //DC refinement reads raw bits and AC-only scans have no DC table
+    const bool needsDC = scan.startOfSelection == 0 && scan.successiveApproxHigh == 0;
+    const bool needsAC = scan.endOfSelection != 0;
+    for (uint i = 0; i < numComponentsInScan; ++i) {
+        const ColorComponent& component = header->colorComponents[scan.componentIndices[i]];
+        if (needsDC) {
+            if (header->dcHuffmanTables[component.dcHuffmanTableID].set == false) {
+                JPG_LOG(LogLevel::Error, "Error - Color component using uninitialized DC huffman table");
+                header->valid = false;
+                return;
+            }
+            scan.dcHuffmanTables[i] = header->dcHuffmanTables[component.dcHuffmanTableID];
+        }
+        if (needsAC) {
+            if (header->acHuffmanTables[component.acHuffmanTableID].set == false) {
+                JPG_LOG(LogLevel::Error, "Error - Color component using uninitialized AC huffman table");
+                header->valid = false;
+                return;
+            }
+            scan.acHuffmanTables[i] = header->acHuffmanTables[component.acHuffmanTableID];
+        }
+    }
+    scan.restartInterval = header->restartInterval;
+    header->scans.push_back(std::move(scan));
+}
+
+
+//find the end of the huffman data that follows an SOS and return the marker that ends it
+//the data is left in place, byte stuffing is removed by the BitReader as it decodes
+byte readScanData (ByteReader& reader, const byte* const data, Header* const header) {
+    Scan& scan = header->scans.back();
+    const std::size_t start = reader.tell();
+    //break manually from the loop on detecting a marker or some error
+    while(true) {
+        //everything up to the next 0xFF is plain huffman data
+        reader.skipUntil(0xFF);
+        reader.get();
+        byte current = reader.get();
+        //ignore multiple 0xFF
+        while (current == 0xFF) {
+            current = reader.get();
+        }
+        if (reader.ended()) {
+            JPG_LOG(LogLevel::Error, "Error - file ended prematurely");
+            header->valid = false;
+            return 0;
+        }
+        //stuffed 0xFF stays in the data
+        if (current == 0x00) {
+            continue;
+        }
+        //restart markers stay in the data too, remember where each interval starts
+        else if (current >= RST0 && current <= RST7) {
+            scan.restartOffsets.push_back(reader.tell() - start);
+            continue;
+        }
+        //any other marker ends the scan
+        scan.huffmanData = data + start;
+        scan.huffmanDataLength = reader.tell() - 2 - start;
+        return current;
+    }
 }
 
 
-//only supporting SOF0 at this time
+//only supporting SOF0 (baseline) and SOF2 (progressive) at this time
 //SOF tells frame type, dimensions, and number of color components
-void readStartOfFrame (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading SOF marker\n";
+void readStartOfFrame (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading SOF marker");
         if(header->numComponents != 0) {
-        std::cout << "Error - multiple SOFs\n";
+        JPG_LOG(LogLevel::Error, "Error - multiple SOFs");
         header->valid = false;
         return;
     }
     
-    uint length = (inFile.get() << 8) + inFile.get();
-    byte precision = inFile.get();
+    uint length = reader.getShort();
+    byte precision = reader.get();
     
     //precision has to be 8 only
     if(precision != 8) {
-        std::cout << "Error - invalid precision\n" << (uint)precision << "\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid precision\n" << (uint)precision);
         header->valid = false;
         return;
     }
 
-    header->height = (inFile.get() << 8) + inFile.get();
-    header->width = (inFile.get() << 8) + inFile.get();
+    header->height = reader.getShort();
+    header->width = reader.getShort();
     if (header->height == 0 || header->width == 0) {
-        std::cout << "Error - invalid dimensions\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid dimensions");
         header->valid = false;
         return;
     }
     
-    header->numComponents = inFile.get();
+    header->numComponents = reader.get();
     if (header->numComponents == 4) {
-        std::cout << "Error - CMYK unsupported\n";
+        JPG_LOG(LogLevel::Error, "Error - CMYK unsupported");
         header->valid = false;
         return;
     }
 
     //read component data
     for(uint i=0; i < header->numComponents; i++) {
-        byte componentID = inFile.get();
+        byte componentID = reader.get();
         
         //componentID is usually 1,2,3 and not 0,1,2 but if we see ID start from 0, force them to start from 1 for consistency
         if (componentID == 0) {
@@ -133,62 +605,91 @@ void readStartOfFrame (std::ifstream& inFile, Header* const header) {
 
 
         if (componentID == 4 || componentID == 5) {
-            std::cout << "Error - YIQ unsupported\n";
+            JPG_LOG(LogLevel::Error, "Error - YIQ unsupported");
             header->valid = false;
             return;
         }
         if (componentID == 0 || componentID > 3) {
-            std::cout << "Error - invalid component\n";
+            JPG_LOG(LogLevel::Error, "Error - invalid component");
             header->valid = false;
             return;
         }
         
         ColorComponent* component = &header->colorComponents[componentID - 1];
         if (component->used) {
-            std::cout << "Error - duplicate color component detected\n";
+            JPG_LOG(LogLevel::Error, "Error - duplicate color component detected");
             header->valid = false;
             return;
         }
         component->used = true;
-        byte samplingFactor = inFile.get();
+        byte samplingFactor = reader.get();
         component->horizontalSamplingFactor = samplingFactor >> 4;
         component->verticalSamplingFactor = samplingFactor & 0x0F;
         
-        //place holder for now, to support SF = 2 later
-        if (component->horizontalSamplingFactor != 1 || component->verticalSamplingFactor !=1) {
-            std::cout << "Error - sampling factor not supported\n";
+        if (component->horizontalSamplingFactor < 1 || component->horizontalSamplingFactor > 4 ||
+            component->verticalSamplingFactor < 1 || component->verticalSamplingFactor > 4) {
+            JPG_LOG(LogLevel::Error, "Error - invalid sampling factor");
             header->valid = false;
             return;
         }
 
-        component->quantizationTableID = inFile.get();
+        component->quantizationTableID = reader.get();
         if (component->quantizationTableID > 3) {
-            std::cout << "Error - invalid quantization table ID in components\n";
+            JPG_LOG(LogLevel::Error, "Error - invalid quantization table ID in components");
             header->valid = false;
             return;
         }
     }
     //if length of bytes read does not line up
     if (length - 8 - (3 * header->numComponents) != 0) {
-        std::cout << "Error invalid SOF marker\n";
+        JPG_LOG(LogLevel::Error, "Error invalid SOF marker");
         header->valid = false;
         return;
     }
+
+    //a single component scan is never interleaved, every MCU is one block whatever the sampling factors say
+    if (header->numComponents == 1) {
+        header->colorComponents[0].horizontalSamplingFactor = 1;
+        header->colorComponents[0].verticalSamplingFactor = 1;
+    }
+    for (uint i = 0; i < header->numComponents; ++i) {
+        if (header->colorComponents[i].horizontalSamplingFactor > header->maxHorizontalSamplingFactor) {
+            header->maxHorizontalSamplingFactor = header->colorComponents[i].horizontalSamplingFactor;
+        }
+        if (header->colorComponents[i].verticalSamplingFactor > header->maxVerticalSamplingFactor) {
+            header->maxVerticalSamplingFactor = header->colorComponents[i].verticalSamplingFactor;
+        }
+    }
+    //every component has to be at full resolution or subsampled by 2 in each direction
+    for (uint i = 0; i < header->numComponents; ++i) {
+        const ColorComponent& component = header->colorComponents[i];
+        const uint horizontalRatio = header->maxHorizontalSamplingFactor / component.horizontalSamplingFactor;
+        const uint verticalRatio = header->maxVerticalSamplingFactor / component.verticalSamplingFactor;
+        if (horizontalRatio * component.horizontalSamplingFactor != header->maxHorizontalSamplingFactor ||
+            verticalRatio * component.verticalSamplingFactor != header->maxVerticalSamplingFactor ||
+            horizontalRatio > 2 || verticalRatio > 2) {
+            JPG_LOG(LogLevel::Error, "Error - sampling factor not supported");
+            header->valid = false;
+            return;
+        }
+    }
+    header->mcuWidth = (header->width + 8 * header->maxHorizontalSamplingFactor - 1) / (8 * header->maxHorizontalSamplingFactor);
+    header->mcuHeight = (header->height + 8 * header->maxVerticalSamplingFactor - 1) / (8 * header->maxVerticalSamplingFactor);
 }
 
 
 //can contain more than one huffman table
-void readHuffmanTable (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading Huffman Tables\n";
-    int length = (inFile.get() << 8) + inFile.get();
+void readHuffmanTable (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading Huffman Tables");
+    int length = reader.getShort();
     length -= 2;
 
     while (length > 0) {
-        byte tableInfo = inFile.get();
+        byte tableInfo = reader.get();
         byte tableID = tableInfo & 0x0F;
         bool acTable = tableInfo >> 4;
         if(tableID > 3) {
-            std::cout << "Error - invalid huffman table ID" << (uint)tableID <<"\n";
+            JPG_LOG(LogLevel::Error, "Error - invalid huffman table ID" << (uint)tableID);
             header->valid = false;
             return;
         }
@@ -207,23 +708,23 @@ void readHuffmanTable (std::ifstream& inFile, Header* const header) {
         uint allSymbols = 0;
         //count all symbols and create offsets for when the next symbol with different length starts
         for(uint i = 1; i <= 16; ++i) {
-            allSymbols += inFile.get();
+            allSymbols += reader.get();
             hTable->offsets[i] = allSymbols;
         }
         if (allSymbols > 162) {
-            std::cout << "Error - too many symbols in HT\n";
+            JPG_LOG(LogLevel::Error, "Error - too many symbols in HT");
             header->valid = false;
             return;
         }
         //store symbols
         for(uint i = 0; i < allSymbols; ++i) {
-            hTable->symbols[i] = inFile.get();
+            hTable->symbols[i] = reader.get();
         }
 
         length -= 17 + allSymbols;
     }
     if (length != 0) {
-        std::cout << "Error - invalid DHT marker\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid DHT marker");
         header->valid = false;
         return;
     }
@@ -231,19 +732,19 @@ void readHuffmanTable (std::ifstream& inFile, Header* const header) {
 
 
 //DQT can contain more than one quantization table
-void readQuantizationTable (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading Quantization tables\n";
-    int length = (inFile.get() << 8) + inFile.get();
+void readQuantizationTable (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading Quantization tables");
+    int length = reader.getShort();
     length -= 2;
 
     while (length > 0) {
-        byte tableInfo = inFile.get();
+        byte tableInfo = reader.get();
         length -= 1;
         //lower nibble contains table ID
         byte tableID = tableInfo & 0x0F;
         
         if(tableID > 3) {
-            std::cout << "Error - invalid Quantization table ID "<< (uint)tableID <<"\n";
+            JPG_LOG(LogLevel::Error, "Error - invalid Quantization table ID "<< (uint)tableID);
             header->valid = false;
             return;
         }
@@ -253,344 +754,396 @@ void readQuantizationTable (std::ifstream& inFile, Header* const header) {
         //check if it is 16-bit quantization table and read it
         if (tableInfo >> 4 != 0) {
             for(uint i = 0; i < 64; ++i) {
-                header->quantizationTables[tableID].table[zigzagMap[i]] = (inFile.get() << 8) + inFile.get();
+                header->quantizationTables[tableID].table[zigzagMap[i]] = reader.getShort();
             }
             length -= 128;
         }
         //8-bit quantization table
         else {
             for (uint i = 0; i < 64; ++i) {
-                header->quantizationTables[tableID].table[zigzagMap[i]] = inFile.get();
+                header->quantizationTables[tableID].table[zigzagMap[i]] = reader.get();
             }
             length -=64;
         }
     }
     //if length is -ve due to subtractions in length
     if (length != 0) {
-        std::cout << "Error - invalid DQT marker\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid DQT marker");
         header->valid = false;
     }
     
 }
 
 
-void readRestartInterval(std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading DRI marker\n";
-    uint length = (inFile.get() << 8) + inFile.get();
+void readRestartInterval(ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading DRI marker");
+    uint length = reader.getShort();
     
-    header->restartInterval = (inFile.get() << 8) + inFile.get();
+    header->restartInterval = reader.getShort();
     if(length - 4 != 0) {
-        std::cout << "Error - invalid DRI marker\n";
+        JPG_LOG(LogLevel::Error, "Error - invalid DRI marker");
         header->valid = false;
     }
 }
 
 
-void readAPPN (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading APPN marker\n";
+void readAPPN (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading APPN marker");
     //next two bytes after any marker contains the length
-    uint length = (inFile.get() << 8) + inFile.get();
-    for (uint i = 0; i < length-2 ; ++i) {
-        inFile.get();
-    }
+    uint length = reader.getShort();
+    reader.skip(length - 2);
 }
 
 
-void readComments (std::ifstream& inFile, Header* const header) {
-    std::cout << "Reading COM marker\n";
+void readComments (ByteReader& reader, Header* const header) {
+    JPG_LOG(LogLevel::Debug, "Reading COM marker");
     //next two bytes after any marker contains the length
-    uint length = (inFile.get() << 8) + inFile.get();
-    for (uint i = 0; i < length-2 ; ++i) {
-        inFile.get();
-    }
+    uint length = reader.getShort();
+    reader.skip(length - 2);
 }
 
 
-Header* readJPG (const std::string& filename) {
-    //open file
-    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
-    if (!inFile.is_open()){
-        std::cout << "Error opening file!\n";
-        return nullptr;
-    }
+//parse a JPEG held in memory into header, which is reset first. the buffer is owned by the caller
+//and has to outlive the header. anything short of ParseDepth::Image leaves the scans out
+//and doesn't need the data past the point it stops at
+void readJPG (const byte* const data, const std::size_t size, Header* const header, const ParseDepth depth = ParseDepth::Image) {
+    JPG_TIME(parseSeconds);
+    //everything but the memory of the scans starts over
+    std::vector<Scan> scans;
+    scans.swap(header->scans);
+    scans.clear();
+    *header = Header();
+    header->scans.swap(scans);
 
-    Header* header = new(std::nothrow) Header;
-    
-    if (header == nullptr) {
-        std::cout << "Memory error!\n";
-        inFile.close();
-        return nullptr;
-    }
+    ByteReader reader(data, size);
 
-    byte last = inFile.get();
-    byte current = inFile.get();
+    byte last = reader.get();
+    byte current = reader.get();
 
     //jpeg images start with FF D8 (start of image)
     if (last != 0xFF || current != SOI) {
-        std::cout<<"Invalid file\n";
+        JPG_LOG(LogLevel::Error, "Invalid file");
         header->valid = false;
-        inFile.close();
-        return header;
+        return;
     }
 
-    last = inFile.get();
-    current = inFile.get();
+    last = reader.get();
+    current = reader.get();
 
     //read markers
     while (header->valid) {
 
         //check if program reaches the end without detecting eof marker
         
-        if (!inFile){
-            std::cout << "Error - file ended prematurely\n";
+        if (reader.ended()){
+            JPG_LOG(LogLevel::Error, "Error - file ended prematurely");
             header->valid = false;
-            inFile.close();
-            return header;
+            header->truncated = true;
+            return;
         }
 
         if (last != 0xFF) {
-            std::cout << "Error - marker expected\n";
+            JPG_LOG(LogLevel::Error, "Error - marker expected");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
 
-        if (current == SOF0) {
-            header->frameType = SOF0;
-            readStartOfFrame(inFile, header);
+        if (current == SOF0 || current == SOF2) {
+            header->frameType = current;
+            readStartOfFrame(reader, header);
+            header->frameRead = header->valid && !reader.ended();
+            if (depth == ParseDepth::Frame && header->frameRead) {
+                break;
+            }
         }
         else if (current == DRI) {
-            readRestartInterval(inFile, header);
+            readRestartInterval(reader, header);
         }
         else if (current == DQT) {
-            readQuantizationTable(inFile, header);
+            readQuantizationTable(reader, header);
         }
         else if (current == DHT) {
-            readHuffmanTable(inFile, header);
+            readHuffmanTable(reader, header);
         }
         else if (current == SOS) {
-            readStartOfScan(inFile, header);
-            break; //delete this
+            if (depth != ParseDepth::Image) {
+                if (header->numComponents == 0) {
+                    JPG_LOG(LogLevel::Error, "Error - SOS detected before SOF");
+                    header->valid = false;
+                }
+                break;
+            }
+            readStartOfScan(reader, header);
+            if (!header->valid) {
+                return;
+            }
+            //the huffman data runs up to the next marker, which is handled on the next pass
+            current = readScanData(reader, data, header);
+            continue;
         }
         else if (current >= APP0 && current <= APP15) {
-            readAPPN(inFile, header);
+            readAPPN(reader, header);
         }
         else if (current == COM) {
-            readComments(inFile, header);
+            readComments(reader, header);
         }
         else if (current == TEM) {
             //TEM is useless empty marker, read the next byte(marker)
         }
         //useless skippable markers
         else if((current >= JPG0 && current <= JPG13) || current == DNL || current == DHP || current == EXP) {
-            readComments(inFile, header);
+            readComments(reader, header);
         }
-        //continous 0x0f are valid, move to next byte
-        else if (current == 0x0F) {
-            current = inFile.get();
+        //any number of 0xFF fill bytes may come before a marker, move to next byte
+        else if (current == 0xFF) {
+            current = reader.get();
             continue;
         }
 
         else if(current == SOI) {
-            std::cout << "Error - embedded jpeg not supported\n";
+            JPG_LOG(LogLevel::Error, "Error - embedded jpeg not supported");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if(current == EOI) {
-            std::cout << "Error - EOI before SOS\n";
-            header->valid = false;
-            inFile.close();
-            return header;
+            if (header->scans.empty()) {
+                JPG_LOG(LogLevel::Error, "Error - EOI before SOS");
+                header->valid = false;
+                return;
+            }
+            break;
         }
         else if(current == DAC) {
-            std::cout << "Error - Arithmetic coding not supported\n";
+            JPG_LOG(LogLevel::Error, "Error - Arithmetic coding not supported");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current >= SOF0 && current <=SOF15) {
-            std::cout << "Error - unsupported SOF\n";
+            JPG_LOG(LogLevel::Error, "Error - unsupported SOF");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current >= RST0 && current <= RST7) {
-            std::cout << "Error - RSTN before SOS\n";
+            JPG_LOG(LogLevel::Error, "Error - RSTN outside of a scan");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else {
-            std::cout << "Error - unknown marker : 0x " << std::hex << current << std::dec << "\n";
+            JPG_LOG(LogLevel::Error, "Error - unknown marker : 0x " << std::hex << current << std::dec);
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         
-        last = inFile.get();
-        current = inFile.get();
+        last = reader.get();
+        current = reader.get();
     }
 
-    //read huffman data after SOS
-    if (header->valid) {
-        current = inFile.get();
-        //break manually from the loop on detecting EOI or some error
-        while(true) {
-            if (!inFile) {
-                std::cout << "Error - file ended prematurely\n";
-                header->valid = false;
-                inFile.close();
-                return header;
-            }
-            //look at two bytes to identify markers
-            last = current;
-            current = inFile.get();
-            if (last == 0xFF) {
-                //check for end of image marker
-                if (current == EOI) {
-                    break;
-                }
-                else if (current == 0x00) {
-                    //store 0xFF in huffman data and ignore 0x00
-                    header->huffmanData.push_back(last);
-                    current = inFile.get();
-                }
-                else if (current == 0xFF) {
-                    //ignore multiple 0xFF
-                    continue;
-                }
-                else if (current >= RST0 && current <= RST7) {
-                    //ignore restart markers and read the next byte
-                    current = inFile.get();
-                }
-                else {
-                    std::cout << "Error - invalid marker while reading huffman data 0x"<<std::hex<<(uint)current<<std::dec<<"\n";
-                    header->valid=false;
-                    inFile.close();
-                    return header;
-                }
-            }
-            else {
-                header->huffmanData.push_back(last);
-            }
-        }
-    }
-    else {
-        return header; // placeholder 2 maybe
+    if (!header->valid) {
+        //a segment cut short reads as zeros and fails its own checks first
+        header->truncated = reader.ended();
+        return;
     }
 
     //verify header info
+    if (depth == ParseDepth::Frame) {
+        return;
+    }
     if(header->numComponents != 1 && header->numComponents != 3) {
-        std::cout << "Error - number of color components need to be 1 or 3";
+        JPG_LOG(LogLevel::Error, "Error - number of color components need to be 1 or 3");
         header->valid=false;
-        inFile.close();
-        return header;
+        return;
     }
 
     for(uint i = 0; i < header->numComponents ; ++i) {
         if (header->quantizationTables[header->colorComponents[i].quantizationTableID].set == false) {
-            std::cout << "Error - Color component using uninitialized quantization table\n";
-            header->valid = false;
-            inFile.close();
-            return header;
-        }
-        else if (header->dcHuffmanTables[header->colorComponents[i].dcHuffmanTableID].set == false) {
-            std::cout << "Error - Color component using uninitialized DC huffman table\n";
+            JPG_LOG(LogLevel::Error, "Error - Color component using uninitialized quantization table");
             header->valid = false;
-            inFile.close();
-            return header;
-        }
-        else if (header->acHuffmanTables[header->colorComponents[i].acHuffmanTableID].set == false) {
-            std::cout << "Error - Color component using uninitialized AC huffman table\n";
-            header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
     }
+}
+
+
+//parse into a new header, the caller deletes it
+Header* readJPG (const byte* const data, const std::size_t size, const ParseDepth depth = ParseDepth::Image) {
+    Header* header = new(std::nothrow) Header;
+    
+    if (header == nullptr) {
+        JPG_LOG(LogLevel::Error, "Memory error!");
+        return nullptr;
+    }
+    readJPG(data, size, header, depth);
+    return header;
+}
+
 
-    inFile.close();
+//parse a JPEG file, mapping it into memory rather than streaming it
+//the header keeps the mapping alive since its huffman data points into it
+Header* readJPG (const std::string& filename) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename);
+    if (!file->isOpen()) {
+        JPG_LOG(LogLevel::Error, "Error opening file!");
+        return nullptr;
+    }
+    Header* header = readJPG(file->data(), file->size());
+    if (header != nullptr) {
+        header->file = file;
+    }
     return header;
 }
 
 
-void printHeader (const Header* const header) {
+//parse only the markers in front of the entropy data, stopping after the frame header or at the first scan.
+//works on a prefix of the file, info.truncated tells when the prefix was too short to get there
+bool probeJPG (const byte* const data, const std::size_t size, ImageInfo& info, const ParseDepth depth = ParseDepth::FirstScan) {
+    info = ImageInfo();
+    Header* header = readJPG(data, size, depth == ParseDepth::Frame ? ParseDepth::Frame : ParseDepth::FirstScan);
     if (header == nullptr) {
+        return false;
+    }
+    info.truncated = header->truncated;
+    info.valid = header->valid;
+    info.frameRead = header->frameRead;
+    info.frameType = header->frameType;
+    info.width = header->width;
+    info.height = header->height;
+    info.numComponents = header->numComponents;
+    for (uint i = 0; i < 3; ++i) {
+        info.horizontalSamplingFactors[i] = header->colorComponents[i].horizontalSamplingFactor;
+        info.verticalSamplingFactors[i] = header->colorComponents[i].verticalSamplingFactor;
+    }
+    info.restartInterval = header->restartInterval;
+    for (uint i = 0; i < 4; ++i) {
+        info.quantizationTables[i] = header->quantizationTables[i].set;
+        info.dcHuffmanTables[i] = header->dcHuffmanTables[i].set;
+        info.acHuffmanTables[i] = header->acHuffmanTables[i].set;
+    }
+    delete header;
+    return info.valid;
+}
+
+//probe a file, it is mapped rather than read so only the pages in front of the entropy data are touched
+bool probeJPG (const std::string& filename, ImageInfo& info, const ParseDepth depth = ParseDepth::FirstScan) {
+    info = ImageInfo();
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        JPG_LOG(LogLevel::Error, "Error opening file!");
+        return false;
+    }
+    return probeJPG(file.data(), file.size(), info, depth);
+}
+
+//one line of key=value pairs describing the probed image
+//an invalid image still gets the fields of its frame header when that was read
+void printImageInfo (std::ostream& out, const std::string& filename, const ImageInfo& info) {
+    out << "file=" << filename;
+    if (!info.valid) {
+        out << " valid=0 truncated=" << info.truncated;
+        if (!info.frameRead) {
+            out << "\n";
+            return;
+        }
+    }
+    else {
+        out << " valid=1";
+    }
+    out << " frame=0x" << std::hex << (uint)info.frameType << std::dec
+        << " width=" << info.width << " height=" << info.height << " components=" << (uint)info.numComponents << " sampling=";
+    for (uint i = 0; i < info.numComponents; ++i) {
+        out << (i > 0 ? "," : "") << (uint)info.horizontalSamplingFactors[i] << "x" << (uint)info.verticalSamplingFactors[i];
+    }
+    out << " restart=" << info.restartInterval;
+    const char* const names[3] = { " dqt=", " dht_dc=", " dht_ac=" };
+    const bool* const tables[3] = { info.quantizationTables, info.dcHuffmanTables, info.acHuffmanTables };
+    for (uint t = 0; t < 3; ++t) {
+        out << names[t];
+        for (uint i = 0; i < 4; ++i) {
+            out << (tables[t][i] ? '1' : '0');
+        }
+    }
+    out << "\n";
+}
+
+
+void printHeader (const Header* const header) {
+    if (header == nullptr || logLevel < LogLevel::Info) {
         return;
     }
-    std::cout << "----------DQT----------\n";
+    std::ostringstream out;
+    out << "----------DQT----------\n";
     for (uint i = 0; i < 4; ++i) {
         if (header->quantizationTables[i].set) {
-            std::cout << "Table ID: " << i <<"\n";
-            std::cout << "Table data:";
+            out << "Table ID: " << i <<"\n";
+            out << "Table data:";
             for (uint j = 0; j < 64; ++j) {
                 if (j % 8 == 0) {
-                    std::cout << "\n";
+                    out << "\n";
                 }
-                std::cout << header->quantizationTables[i].table[j] << ' ';
+                out << header->quantizationTables[i].table[j] << ' ';
             }
-            std::cout << "\n";
+            out << "\n";
         }
     }
-    std::cout << "----------SOF----------\n";
-    std::cout << "Frame type = 0x" << std::hex << (uint)header->frameType << std::dec << "\n";
-    std::cout << "Height = " << header->height << "\n";
-    std::cout << "Width = " << header->width << "\n";
+    out << "----------SOF----------\n";
+    out << "Frame type = 0x" << std::hex << (uint)header->frameType << std::dec << "\n";
+    out << "Height = " << header->height << "\n";
+    out << "Width = " << header->width << "\n";
     for(uint i = 0; i < header->numComponents; i++) {
-        std::cout << "Component ID = " << i+1 <<"\n";
-        std::cout << "Horizontal Sampling Factor = " << (uint)header->colorComponents[i].horizontalSamplingFactor << "\n";
-        std::cout << "Vertical Sampling Factor = " << (uint)header->colorComponents[i].verticalSamplingFactor << "\n";
-        std::cout << "Quantization Table used (ID) = " << (uint)header->colorComponents[i].quantizationTableID << "\n";
-    }
-    std::cout << "\n----------DRI----------\n";
-    std::cout << "Restart interval = " << header->restartInterval << "\n";
-    std::cout << "\n----------Huffman Tables---------- \n";
-    std::cout << "DC Tables :\n";
+        out << "Component ID = " << i+1 <<"\n";
+        out << "Horizontal Sampling Factor = " << (uint)header->colorComponents[i].horizontalSamplingFactor << "\n";
+        out << "Vertical Sampling Factor = " << (uint)header->colorComponents[i].verticalSamplingFactor << "\n";
+        out << "Quantization Table used (ID) = " << (uint)header->colorComponents[i].quantizationTableID << "\n";
+    }
+    out << "\n----------DRI----------\n";
+    out << "Restart interval = " << header->restartInterval << "\n";
+    out << "\n----------Huffman Tables---------- \n";
+    out << "DC Tables :\n";
     for(uint i = 0; i < 4; ++i) {
         if (header->dcHuffmanTables[i].set) {
-            std::cout << "Table ID: "<<i<<std::endl;
-            std::cout << "Symbols :\n";
+            out << "Table ID: "<<i<<std::endl;
+            out << "Symbols :\n";
             for (uint j = 0; j < 16; ++j) {
-                std::cout<< (j+1) <<": ";  //(j+1) = code length
+                out<< (j+1) <<": ";  //(j+1) = code length
                 for(uint k = header->dcHuffmanTables[i].offsets[j]; k < header->dcHuffmanTables[i].offsets[j+1]; ++k) {
-                    std::cout<< std::hex << (uint)header->dcHuffmanTables[i].symbols[k] << std::dec << " ";
+                    out<< std::hex << (uint)header->dcHuffmanTables[i].symbols[k] << std::dec << " ";
                 }
-                std::cout<<std::endl;
+                out<<std::endl;
             }
         }
     }
 
-    std::cout << "AC Tables :\n";
+    out << "AC Tables :\n";
     for(uint i = 0; i < 4; ++i) {
         if (header->acHuffmanTables[i].set) {
-            std::cout << "Table ID: "<<i<<std::endl;
-            std::cout << "Symbols :\n";
+            out << "Table ID: "<<i<<std::endl;
+            out << "Symbols :\n";
             for (uint j = 0; j < 16; ++j) {
-                std::cout<< (j+1) <<": ";  //(j+1) = code length
+                out<< (j+1) <<": ";  //(j+1) = code length
                 for(uint k = header->acHuffmanTables[i].offsets[j]; k < header->acHuffmanTables[i].offsets[j+1]; ++k) {
-                    std::cout<< std::hex << (uint)header->acHuffmanTables[i].symbols[k] << std::dec << " ";
+                    out<< std::hex << (uint)header->acHuffmanTables[i].symbols[k] << std::dec << " ";
                 }
-                std::cout<<std::endl;
+                out<<std::endl;
             }
         }
     }
-    std::cout << "\n----------SOS----------\n";
-    std::cout << "Start of selection : " << (uint)header->startOfSelection << "\n";
-    std::cout << "End of selection : " << (uint)header->endOfSelection << "\n";
-    std::cout << "successive approximation high : "<< (uint)header->successiveApproxHigh << "\n";
-    std::cout << "successive approximation low : " << (uint)header->successiveApproxLow << "\n";
-    std::cout << "Color components :\n";
-    for(uint i=0; i<header->numComponents; ++i) {
-        std::cout << "Component ID : " <<(i+1)<<"\n";
-        std::cout << "DC Huffman Table ID: "<<(uint)header->colorComponents[i].dcHuffmanTableID<<"\n";
-        std::cout << "AC Huffman Table ID: "<<(uint)header->colorComponents[i].acHuffmanTableID<<"\n";
+    for (const Scan& scan : header->scans) {
+        out << "\n----------SOS----------\n";
+        out << "Start of selection : " << (uint)scan.startOfSelection << "\n";
+        out << "End of selection : " << (uint)scan.endOfSelection << "\n";
+        out << "successive approximation high : "<< (uint)scan.successiveApproxHigh << "\n";
+        out << "successive approximation low : " << (uint)scan.successiveApproxLow << "\n";
+        out << "Color components :\n";
+        for(uint i=0; i<scan.numComponents; ++i) {
+            out << "Component ID : " <<(uint)(scan.componentIndices[i]+1)<<"\n";
+        }
+        out << "Restart interval : " << scan.restartInterval << "\n";
+        out << "Length of huffman data : " << scan.huffmanDataLength << "\n";
     }
-    std::cout << "Length of huffman data : " << header->huffmanData.size() << "\n";
-
+    logSink(LogLevel::Info, out.str());
 }
 
 //output huffman codes from symbols in huffman table stored in 1-D array
-void getCodes(HuffmanTable& const htable) {
+void getCodes(HuffmanTable& htable) {
     uint code = 0;
 
     //for all code lengths (0-15)
@@ -612,182 +1165,3218 @@ void getCodes(HuffmanTable& const htable) {
     }
 }
 
-//helper class to read bits from byte vector
-class BitReader {
-    private:
-        uint nextBit = 0;
-        uint nextByte = 0;
-        const std::vector<byte>& data;
-    public:
-        BitReader(const std::vector<byte>& d) : data(d) {}
+//compile the codes of a huffman table into lookup tables
+//codes of up to HUFFMAN_LOOKUP_BITS bits are resolved with a single table read,
+//longer codes fall back to comparing against the largest code of each length
+void buildLookupTables(HuffmanTable& htable) {
+    const uint lookupSize = 1 << HUFFMAN_LOOKUP_BITS;
+    for (uint i = 0; i < lookupSize; ++i) {
+        htable.lookup[i] = 0;
+        htable.acLookup[i] = 0;
+    }
 
-        //read one bit or return -1 if all bits have been read
-        int readBit() {
-            if(nextByte >= data.size()) {
-                return -1;
-            }
-            int bit = (data[nextByte] >> (7-nextBit)) & 1;
-            nextBit += 1;
-            if(nextBit == 8) {
-                nextBit = 0;
-                nextByte += 1;
-            }
-            return bit;
+    for (uint length = 1; length <= 16; ++length) {
+        const uint first = htable.offsets[length - 1];
+        const uint last = htable.offsets[length];
+        if (first == last) {
+            htable.maxCode[length] = -1;
+            continue;
         }
+        htable.maxCode[length] = htable.codes[last - 1];
+        htable.valueOffset[length] = (int)first - (int)htable.codes[first];
 
-        int readMultipleBits(const uint length) {
-            int bits = 0;
-            for (uint i=0; i < length; ++i) {
-                int bit = readBit();
-                if (bit == -1) {
-                    bits = -1;
-                    break;
-                }
-                bits = (bits << 1) | bit;
+        if (length > HUFFMAN_LOOKUP_BITS) {
+            continue;
+        }
+        //every index that starts with this code maps to its symbol
+        const uint shift = HUFFMAN_LOOKUP_BITS - length;
+        for (uint j = first; j < last; ++j) {
+            //skip codes that overflow their length in a malformed table
+            if (htable.codes[j] >= (1u << length)) {
+                continue;
+            }
+            const uint base = htable.codes[j] << shift;
+            for (uint k = 0; k < (1u << shift); ++k) {
+                htable.lookup[base + k] = (htable.symbols[j] << 8) | length;
             }
-            return bits;
         }
-};
+    }
+
+    //fold the magnitude bits of short AC run/size pairs into a second table
+    for (uint i = 0; i < lookupSize; ++i) {
+        const uint length = htable.lookup[i] & 0xFF;
+        if (length == 0) {
+            continue;
+        }
+        const byte symbol = htable.lookup[i] >> 8;
+        const uint run = symbol >> 4;
+        const uint coeffLength = symbol & 0x0F;
+        //EOB and ZRL carry no magnitude
+        if (coeffLength == 0 || length + coeffLength > HUFFMAN_LOOKUP_BITS) {
+            continue;
+        }
+        int coeff = (i >> (HUFFMAN_LOOKUP_BITS - length - coeffLength)) & ((1 << coeffLength) - 1);
+        if (coeff < (1 << (coeffLength - 1))) {
+            coeff -= (1 << coeffLength) - 1;
+        }
+        if (coeff >= -128 && coeff <= 127) {
+            htable.acLookup[i] = (short)((coeff * 256) + (run << 4) + length + coeffLength);
+        }
+    }
+}
+
+//helper class to read bits from the byte stuffed huffman data
+//bits are kept in a 64-bit buffer that is refilled whole bytes at a time and
+//stuffed 0xFF00 pairs are collapsed during refill, so the data is never copied.
+//reading past the end of the data or into a marker returns zero bits
+class BitReader {
+    private:
+        uint64_t buffer = 0;
+        uint bitCount = 0;
+        //zero bytes fed into the buffer after the data ran out
+        uint paddingBytes = 0;
+        std::size_t nextByte = 0;
+        const byte* data;
+        std::size_t size;
+
+        //top up the buffer so it holds at least 57 bits
+        void refill() {
+            //fast path, 8 bytes without any 0xFF need no unstuffing
+            if (nextByte + 8 <= size) {
+                const byte* p = data + nextByte;
+                const uint64_t word = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                                      ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+                const uint64_t inverted = ~word;
+                const bool hasFF = ((inverted - 0x0101010101010101ULL) & ~inverted & 0x8080808080808080ULL) != 0;
+                if (!hasFF) {
+                    const uint count = (64 - bitCount) / 8;
+                    buffer |= (word >> (64 - count * 8)) << (64 - bitCount - count * 8);
+                    bitCount += count * 8;
+                    nextByte += count;
+                    return;
+                }
+            }
+            while (bitCount <= 56) {
+                uint64_t value = 0;
+                if (nextByte < size) {
+                    value = data[nextByte];
+                    if (value == 0xFF) {
+                        const byte next = nextByte + 1 < size ? data[nextByte + 1] : 0;
+                        if (next == 0x00) {
+                            nextByte += 2;
+                            JPG_COUNT(bytesUnstuffed, 1);
+                        }
+                        else if (next == 0xFF) {
+                            //fill byte before a marker
+                            nextByte += 1;
+                            continue;
+                        }
+                        else {
+                            //reached a marker, stay on it and pad with zeros
+                            value = 0;
+                            paddingBytes += 1;
+                        }
+                    }
+                    else {
+                        nextByte += 1;
+                    }
+                }
+                else {
+                    paddingBytes += 1;
+                }
+                buffer |= value << (56 - bitCount);
+                bitCount += 8;
+            }
+        }
+    public:
+        BitReader(const byte* const d, const std::size_t s) : data(d), size(s) {}
+
+        //look at the next length (up to 32) bits without consuming them
+        uint peek(const uint length) {
+            if (bitCount < length) {
+                refill();
+            }
+            return (uint)(buffer >> (63 - length) >> 1);
+        }
+
+        void consume(const uint length) {
+            JPG_COUNT(bitsConsumed, length);
+            buffer <<= length;
+            bitCount -= length;
+        }
+
+        uint getBits(const uint length) {
+            const uint bits = peek(length);
+            consume(length);
+            return bits;
+        }
+
+        //true once some of the zero padding has been consumed
+        bool pastEnd() const {
+            return paddingBytes * 8 > bitCount;
+        }
+};
+
+
+//decode the next huffman symbol or return -1 for an invalid code
+int getNextSymbol(BitReader& b, const HuffmanTable& hTable) {
+    const unsigned short entry = hTable.lookup[b.peek(HUFFMAN_LOOKUP_BITS)];
+    if (entry != 0) {
+        b.consume(entry & 0xFF);
+        return entry >> 8;
+    }
+
+    //code is longer than the lookup, compare against the largest code of each length
+    JPG_COUNT(huffmanSlowPath, 1);
+    const uint bits = b.peek(16);
+    for (uint length = HUFFMAN_LOOKUP_BITS + 1; length <= 16; ++length) {
+        const int code = bits >> (16 - length);
+        if (code <= hTable.maxCode[length]) {
+            b.consume(length);
+            return hTable.symbols[hTable.valueOffset[length] + code];
+        }
+    }
+    return -1;
+}
+
+
+//fill coefficients of an MCU component based on Huffman Codes
+//read from bit-reader, lastIndex receives the zigzag index of the last coefficient set
+bool decodeMCUComponent(BitReader &b, int16_t* const component, byte& lastIndex, int& previousDC, const HuffmanTable& dcTable, const HuffmanTable& acTable) {
+    for (uint i = 0; i < 64; ++i) {
+        component[i] = 0;
+    }
+    lastIndex = 0;
+
+    //get DC values for this mcu component
+    int length = getNextSymbol(b, dcTable);
+    if (length == -1) {
+        JPG_LOG(LogLevel::Error, "Error - invalid DC value");
+        return false;
+    }
+    if (length > 11) {
+        JPG_LOG(LogLevel::Error, "Error - DC coefficient length greater than 11");
+        return false;
+    }
+    int coeff = b.getBits(length);
+    if (length != 0 && coeff < (1 << (length - 1))) {
+        coeff -= (1 << length) - 1;
+    }
+    component[0] = coeff + previousDC;
+    previousDC = component[0];
+
+    //get AC values for this mcu component
+    uint i = 1;
+    while (i < 64) {
+        //short run/size pairs come out of the lookup with their magnitude already applied
+        const short fast = acTable.acLookup[b.peek(HUFFMAN_LOOKUP_BITS)];
+        if (fast != 0) {
+            i += (fast >> 4) & 0x0F;
+            if (i >= 64) {
+                JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded MCU");
+                return false;
+            }
+            b.consume(fast & 0x0F);
+            component[zigzagMap[i]] = fast >> 8;
+            lastIndex = i;
+            ++i;
+            continue;
+        }
+
+        int symbol = getNextSymbol(b, acTable);
+        if (symbol == -1) {
+            JPG_LOG(LogLevel::Error, "Error - invalid AC value");
+            return false;
+        }
+        //symbol 0x00 means fill remainder of component with 0
+        if (symbol == 0x00) {
+            return true;
+        }
+
+        //otherwise read next component coefficient
+        uint numZeroes = symbol >> 4;
+        byte coeffLength = symbol & 0x0F;
+        //symbol 0xF0 means skip 16 0's
+        if (symbol == 0xF0) {
+            numZeroes = 16;
+        }
+        if (i + numZeroes >= 64) {
+            JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded MCU");
+            return false;
+        }
+        i += numZeroes;
+
+        if (coeffLength > 10) {
+            JPG_LOG(LogLevel::Error, "Error - AC coefficient length greater than 10");
+            return false;
+        }
+        if (coeffLength != 0) {
+            coeff = b.getBits(coeffLength);
+            if (coeff < (1 << (coeffLength - 1))) {
+                coeff -= (1 << coeffLength) - 1;
+            }
+            component[zigzagMap[i]] = coeff;
+            lastIndex = i;
+            ++i;
+        }
+    }
+    return true;
+}
+
+
+//read past a block of a sequential scan without storing it, only its DC prediction is kept
+bool skipMCUComponent(BitReader& b, int& previousDC, const HuffmanTable& dcTable, const HuffmanTable& acTable) {
+    const int length = getNextSymbol(b, dcTable);
+    if (length == -1) {
+        JPG_LOG(LogLevel::Error, "Error - invalid DC value");
+        return false;
+    }
+    if (length > 11) {
+        JPG_LOG(LogLevel::Error, "Error - DC coefficient length greater than 11");
+        return false;
+    }
+    int coeff = b.getBits(length);
+    if (length != 0 && coeff < (1 << (length - 1))) {
+        coeff -= (1 << length) - 1;
+    }
+    previousDC += coeff;
+
+    uint i = 1;
+    while (i < 64) {
+        const short fast = acTable.acLookup[b.peek(HUFFMAN_LOOKUP_BITS)];
+        if (fast != 0) {
+            i += (fast >> 4) & 0x0F;
+            if (i >= 64) {
+                JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded MCU");
+                return false;
+            }
+            b.consume(fast & 0x0F);
+            ++i;
+            continue;
+        }
+        const int symbol = getNextSymbol(b, acTable);
+        if (symbol == -1) {
+            JPG_LOG(LogLevel::Error, "Error - invalid AC value");
+            return false;
+        }
+        if (symbol == 0x00) {
+            return true;
+        }
+        const uint numZeroes = symbol == 0xF0 ? 16 : symbol >> 4;
+        const uint coeffLength = symbol & 0x0F;
+        if (i + numZeroes >= 64) {
+            JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded MCU");
+            return false;
+        }
+        if (coeffLength > 10) {
+            JPG_LOG(LogLevel::Error, "Error - AC coefficient length greater than 10");
+            return false;
+        }
+        i += numZeroes;
+        if (coeffLength != 0) {
+            b.getBits(coeffLength);
+            ++i;
+        }
+    }
+    return true;
+}
+
+
+//turn the magnitude bits of a coefficient into its signed value
+inline int extendCoefficient(const int bits, const uint length) {
+    if (length != 0 && bits < (1 << (length - 1))) {
+        return bits - (1 << length) + 1;
+    }
+    return bits;
+}
+
+
+//first DC scan of a progressive image, the value is scaled up by the point transform
+bool decodeDCFirst(BitReader& b, int16_t* const block, int& previousDC, const HuffmanTable& dcTable, const uint successiveApproxLow) {
+    const int length = getNextSymbol(b, dcTable);
+    if (length == -1) {
+        JPG_LOG(LogLevel::Error, "Error - invalid DC value");
+        return false;
+    }
+    if (length > 11) {
+        JPG_LOG(LogLevel::Error, "Error - DC coefficient length greater than 11");
+        return false;
+    }
+    previousDC += extendCoefficient(b.getBits(length), length);
+    block[0] = previousDC * (1 << successiveApproxLow);
+    return true;
+}
+
+//DC refinement scans send one more bit of every DC coefficient uncoded
+void decodeDCRefine(BitReader& b, int16_t* const block, const uint successiveApproxLow) {
+    if (b.getBits(1)) {
+        block[0] |= 1 << successiveApproxLow;
+    }
+}
+
+//first scan of a band of AC coefficients [start, end]
+//an end of band run covers this block and eobRun more, which are skipped without reading anything
+bool decodeACFirst(BitReader& b, int16_t* const block, byte& lastIndex, const HuffmanTable& acTable, const uint start, const uint end, const uint successiveApproxLow, uint& eobRun) {
+    if (eobRun > 0) {
+        --eobRun;
+        return true;
+    }
+    const int scale = 1 << successiveApproxLow;
+    uint i = start;
+    while (i <= end) {
+        //short run/size pairs come out of the lookup with their magnitude already applied
+        const short fast = acTable.acLookup[b.peek(HUFFMAN_LOOKUP_BITS)];
+        if (fast != 0) {
+            i += (fast >> 4) & 0x0F;
+            if (i > end) {
+                JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded spectral band");
+                return false;
+            }
+            b.consume(fast & 0x0F);
+            block[zigzagMap[i]] = (fast >> 8) * scale;
+            lastIndex = i > lastIndex ? i : lastIndex;
+            ++i;
+            continue;
+        }
+
+        const int symbol = getNextSymbol(b, acTable);
+        if (symbol == -1) {
+            JPG_LOG(LogLevel::Error, "Error - invalid AC value");
+            return false;
+        }
+        const uint numZeroes = symbol >> 4;
+        const uint coeffLength = symbol & 0x0F;
+        if (coeffLength == 0) {
+            //EOBn ends this block and the following 2^n - 1 + (n extra bits) blocks
+            if (numZeroes < 15) {
+                eobRun = (1u << numZeroes) - 1;
+                if (numZeroes != 0) {
+                    eobRun += b.getBits(numZeroes);
+                }
+                return true;
+            }
+            //symbol 0xF0 means skip 16 0's
+            if (i + 16 > end + 1) {
+                JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded spectral band");
+                return false;
+            }
+            i += 16;
+            continue;
+        }
+        if (i + numZeroes > end) {
+            JPG_LOG(LogLevel::Error, "Error - zero run-length exceeded spectral band");
+            return false;
+        }
+        if (coeffLength > 10) {
+            JPG_LOG(LogLevel::Error, "Error - AC coefficient length greater than 10");
+            return false;
+        }
+        i += numZeroes;
+        block[zigzagMap[i]] = extendCoefficient(b.getBits(coeffLength), coeffLength) * scale;
+        lastIndex = i > lastIndex ? i : lastIndex;
+        ++i;
+    }
+    return true;
+}
+
+//a coefficient that is already nonzero gets one correction bit, which moves it away from zero
+inline void refineCoefficient(BitReader& b, int16_t* const coefficient, const int bit) {
+    if (b.getBits(1) && (*coefficient & bit) == 0) {
+        *coefficient += *coefficient >= 0 ? bit : -bit;
+    }
+}
+
+//AC refinement scan, runs count only coefficients that are still zero and every nonzero
+//coefficient passed on the way reads a correction bit, the same goes for the rest of a block
+//inside an end of band run
+bool decodeACRefine(BitReader& b, int16_t* const block, byte& lastIndex, const HuffmanTable& acTable, const uint start, const uint end, const uint successiveApproxLow, uint& eobRun) {
+    const int bit = 1 << successiveApproxLow;
+    uint i = start;
+    if (eobRun == 0) {
+        for (; i <= end; ++i) {
+            const int symbol = getNextSymbol(b, acTable);
+            if (symbol == -1) {
+                JPG_LOG(LogLevel::Error, "Error - invalid AC value");
+                return false;
+            }
+            uint numZeroes = symbol >> 4;
+            const uint coeffLength = symbol & 0x0F;
+            int coeff = 0;
+            if (coeffLength != 0) {
+                //newly nonzero coefficients always have a magnitude of one
+                if (coeffLength != 1) {
+                    JPG_LOG(LogLevel::Error, "Error - invalid AC refinement value");
+                    return false;
+                }
+                coeff = b.getBits(1) ? bit : -bit;
+            }
+            else if (numZeroes != 15) {
+                eobRun = 1u << numZeroes;
+                if (numZeroes != 0) {
+                    eobRun += b.getBits(numZeroes);
+                }
+                break;
+            }
+
+            //skip numZeroes zero coefficients and stop on the next one
+            for (; i <= end; ++i) {
+                int16_t* const coefficient = block + zigzagMap[i];
+                if (*coefficient != 0) {
+                    refineCoefficient(b, coefficient, bit);
+                }
+                else {
+                    if (numZeroes == 0) {
+                        break;
+                    }
+                    --numZeroes;
+                }
+            }
+            if (coeff != 0 && i <= end) {
+                block[zigzagMap[i]] = coeff;
+                lastIndex = i > lastIndex ? i : lastIndex;
+            }
+        }
+    }
+    if (eobRun > 0) {
+        for (; i <= end; ++i) {
+            int16_t* const coefficient = block + zigzagMap[i];
+            if (*coefficient != 0) {
+                refineCoefficient(b, coefficient, bit);
+            }
+        }
+        --eobRun;
+    }
+    return true;
+}
+
+
+//decode the units [firstUnit, lastUnit) of a scan, continuing from the state left by the previous units
+//a unit is an MCU when the scan interleaves components and a single block when it holds just one.
+//without coefficients the units of a sequential scan are only read past to carry the DC predictions
+bool decodeUnits(const Header* const header, const Scan& scan, ComponentCoefficients* const coefficients, const uint unitsWide,
+                 const uint firstUnit, const uint lastUnit, BitReader& reader, int* const previousDCs, uint& eobRun) {
+    const bool progressive = header->frameType == SOF2;
+    const uint start = scan.startOfSelection;
+    const uint end = scan.endOfSelection;
+    const uint successiveApproxLow = scan.successiveApproxLow;
+
+    //i is the position of the component in the scan
+    auto decodeBlock = [&](ComponentCoefficients* const component, const uint row, const uint column, const uint i) {
+        if (component == nullptr) {
+            return skipMCUComponent(reader, previousDCs[i], scan.dcHuffmanTables[i], scan.acHuffmanTables[i]);
+        }
+        int16_t* const block = component->block(row, column);
+        byte& lastIndex = component->lastIndex(row, column);
+        if (!progressive) {
+            return decodeMCUComponent(reader, block, lastIndex, previousDCs[i], scan.dcHuffmanTables[i], scan.acHuffmanTables[i]);
+        }
+        if (start == 0) {
+            if (scan.successiveApproxHigh == 0) {
+                return decodeDCFirst(reader, block, previousDCs[i], scan.dcHuffmanTables[i], successiveApproxLow);
+            }
+            decodeDCRefine(reader, block, successiveApproxLow);
+            return true;
+        }
+        if (scan.successiveApproxHigh == 0) {
+            return decodeACFirst(reader, block, lastIndex, scan.acHuffmanTables[i], start, end, successiveApproxLow, eobRun);
+        }
+        return decodeACRefine(reader, block, lastIndex, scan.acHuffmanTables[i], start, end, successiveApproxLow, eobRun);
+    };
+
+    for(uint u = firstUnit; u < lastUnit; ++u) {
+        const uint unitRow = u / unitsWide;
+        const uint unitColumn = u % unitsWide;
+        if (scan.numComponents == 1) {
+            ComponentCoefficients* const component = coefficients != nullptr ? &coefficients[scan.componentIndices[0]] : nullptr;
+            if (!decodeBlock(component, unitRow, unitColumn, 0)) {
+                return false;
+            }
+        }
+        else {
+            //an MCU holds horizontalSamplingFactor x verticalSamplingFactor blocks of each component
+            for(uint j = 0; j < scan.numComponents; ++j) {
+                const uint index = scan.componentIndices[j];
+                const ColorComponent& component = header->colorComponents[index];
+                for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
+                    for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
+                        if (!decodeBlock(coefficients != nullptr ? &coefficients[index] : nullptr, unitRow * component.verticalSamplingFactor + v,
+                                         unitColumn * component.horizontalSamplingFactor + h, j)) {
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+        //the reader pads with zeros, so running out of data shows up here
+        if (reader.pastEnd()) {
+            JPG_LOG(LogLevel::Error, "Error - huffman data ended prematurely");
+            return false;
+        }
+    }
+    return true;
+}
+
+//decode the units [firstUnit, lastUnit) of one restart interval of a scan
+//every interval starts byte aligned with its DC predictions and end of band run reset to 0
+bool decodeRestartInterval(const Header* const header, const Scan& scan, ComponentCoefficients* const coefficients, const uint unitsWide,
+                           const uint firstUnit, const uint lastUnit, const std::size_t offset, const std::size_t length) {
+    JPG_COUNT(restartIntervals, 1);
+    BitReader reader(scan.huffmanData + offset, length);
+    int previousDCs[3] = {0};
+    uint eobRun = 0;
+    return decodeUnits(header, scan, coefficients, unitsWide, firstUnit, lastUnit, reader, previousDCs, eobRun);
+}
+
+//byte range within the huffman data of restart interval i
+//interval i starts after restart marker i-1 and ends before restart marker i
+void intervalRange(const Scan& scan, const uint i, const uint numIntervals, std::size_t& start, std::size_t& end) {
+    start = i == 0 ? 0 : scan.restartOffsets[i - 1];
+    end = i + 1 < numIntervals ? scan.restartOffsets[i] - 2 : scan.huffmanDataLength;
+}
+
+
+//build the code lookups of the tables a scan uses
+void buildScanTables(Scan& scan) {
+    for(uint i = 0; i < scan.numComponents; ++i) {
+        if(scan.dcHuffmanTables[i].set) {
+            getCodes(scan.dcHuffmanTables[i]);
+            buildLookupTables(scan.dcHuffmanTables[i]);
+        }
+        if(scan.acHuffmanTables[i].set) {
+            getCodes(scan.acHuffmanTables[i]);
+            buildLookupTables(scan.acHuffmanTables[i]);
+        }
+    }
+}
+
+
+//threads kept between scans and images so parallel work doesn't start and join its own every time
+//start(numTasks, task) runs task(t) for t in [0, numTasks), each on a thread of its own, and wait returns
+//once all of them have. the threads are created the first time that many are asked for and live until the pool goes
+class WorkerPool {
+    private:
+        std::vector<std::thread> threads;
+        std::function<void(uint)> task;
+        uint numTasks = 0;
+        uint running = 0;
+        //counts the calls to start, a thread runs its task once for each
+        uint64_t generation = 0;
+        bool stopping = false;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        void work(const uint index) {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                wake.wait(guard, [&]() { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                if (index >= numTasks) {
+                    continue;
+                }
+                guard.unlock();
+                task(index);
+                guard.lock();
+                if (--running == 0) {
+                    done.notify_all();
+                }
+            }
+        }
+    public:
+        WorkerPool() = default;
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        //the tasks of the last start have to be waited for first
+        void start(const uint count, const std::function<void(uint)>& function) {
+            std::lock_guard<std::mutex> guard(lock);
+            while (threads.size() < count) {
+                const uint index = threads.size();
+                threads.emplace_back([this, index]() { work(index); });
+            }
+            task = function;
+            numTasks = count;
+            running = count;
+            ++generation;
+            wake.notify_all();
+        }
+
+        void wait() {
+            std::unique_lock<std::mutex> guard(lock);
+            done.wait(guard, [this]() { return running == 0; });
+        }
+};
+
+//the pool of buffers, created the first time a decode with them runs in parallel
+WorkerPool& workerPool(DecodeBuffers& buffers) {
+    if (!buffers.workers) {
+        buffers.workers = std::make_shared<WorkerPool>();
+    }
+    return *buffers.workers;
+}
+
+
+//decode the part of one scan that covers the MCU rows [firstMCURow, lastMCURow) into the coefficients of its components
+//decoding stops after those rows and restart intervals that end before them are skipped,
+//intervals are only decoded in parallel when the scan has restart markers, on the threads of workers
+bool decodeScan(const Header* const header, const Scan& scan, ComponentCoefficients* const coefficients, WorkerPool& workers,
+                uint numThreads, const uint firstMCURow, const uint lastMCURow) {
+    //a scan of a single component covers just the blocks inside the image, not whole MCUs
+    uint unitsWide = header->mcuWidth;
+    uint unitsHigh = header->mcuHeight;
+    if (scan.numComponents == 1) {
+        const ColorComponent& component = header->colorComponents[scan.componentIndices[0]];
+        const uint componentWidth = (header->width * component.horizontalSamplingFactor + header->maxHorizontalSamplingFactor - 1) / header->maxHorizontalSamplingFactor;
+        const uint componentHeight = (header->height * component.verticalSamplingFactor + header->maxVerticalSamplingFactor - 1) / header->maxVerticalSamplingFactor;
+        unitsWide = (componentWidth + 7) / 8;
+        unitsHigh = (componentHeight + 7) / 8;
+    }
+    const uint numUnits = unitsWide * unitsHigh;
+    //single component units are blocks, so an MCU row is verticalSamplingFactor rows of them
+    const uint unitRowsPerMCURow = scan.numComponents == 1 ? header->colorComponents[scan.componentIndices[0]].verticalSamplingFactor : 1;
+    const uint firstRow = firstMCURow < header->mcuHeight ? firstMCURow : header->mcuHeight;
+    const uint lastRow = lastMCURow < header->mcuHeight ? lastMCURow : header->mcuHeight;
+    const uint firstNeeded = firstRow * unitRowsPerMCURow * unitsWide < numUnits ? firstRow * unitRowsPerMCURow * unitsWide : numUnits;
+    const uint lastNeeded = lastRow * unitRowsPerMCURow * unitsWide < numUnits ? lastRow * unitRowsPerMCURow * unitsWide : numUnits;
+
+    //without DRI the whole scan is one interval
+    const uint unitsPerInterval = scan.restartInterval != 0 ? scan.restartInterval : numUnits;
+    const uint numIntervals = (numUnits + unitsPerInterval - 1) / unitsPerInterval;
+    if (scan.restartOffsets.size() + 1 < numIntervals) {
+        JPG_LOG(LogLevel::Error, "Error - missing restart markers");
+        return false;
+    }
+
+    if (firstNeeded >= lastNeeded) {
+        return true;
+    }
+    const uint firstInterval = firstNeeded / unitsPerInterval;
+    const uint lastInterval = (lastNeeded + unitsPerInterval - 1) / unitsPerInterval;
+
+    auto decodeInterval = [header, &scan, coefficients, unitsWide, unitsPerInterval, lastNeeded, numIntervals](const uint i) {
+        std::size_t start = 0;
+        std::size_t end = 0;
+        intervalRange(scan, i, numIntervals, start, end);
+        const uint lastUnit = (i + 1) * unitsPerInterval < lastNeeded ? (i + 1) * unitsPerInterval : lastNeeded;
+        return decodeRestartInterval(header, scan, coefficients, unitsWide, i * unitsPerInterval, lastUnit, start, end - start);
+    };
+
+    if (numThreads == 0) {
+        numThreads = std::thread::hardware_concurrency();
+    }
+    if (numThreads > lastInterval - firstInterval) {
+        numThreads = lastInterval - firstInterval;
+    }
+
+    bool success = true;
+    if (numThreads <= 1) {
+        for (uint i = firstInterval; i < lastInterval && success; ++i) {
+            success = decodeInterval(i);
+        }
+    }
+    else {
+        //workers claim intervals from a shared counter, the blocks they write never overlap
+        std::atomic<uint> nextInterval(firstInterval);
+        std::atomic<bool> failed(false);
+#if defined(JPG_STATS)
+        //each worker counts on its own thread, the counts join the ones of this thread at the end
+        std::mutex statsLock;
+        DecodeStats workerStats;
+#endif
+        workers.start(numThreads, [&](uint) {
+            for (uint i = nextInterval++; i < lastInterval && !failed; i = nextInterval++) {
+                if (!decodeInterval(i)) {
+                    failed = true;
+                }
+            }
+#if defined(JPG_STATS)
+            std::lock_guard<std::mutex> guard(statsLock);
+            addStats(workerStats, threadStats);
+            threadStats = DecodeStats();
+#endif
+        });
+        workers.wait();
+#if defined(JPG_STATS)
+        addStats(threadStats, workerStats);
+#endif
+        success = !failed;
+    }
+
+    return success;
+}
+
+
+//size the blocks of a component for blocksWide x blocksHigh and zero them
+//a header can ask for far more memory than there is, that fails the decode instead of throwing
+bool clearCoefficients(ComponentCoefficients& coefficients) {
+    const std::size_t numBlocks = (std::size_t)coefficients.blocksWide * coefficients.blocksHigh;
+    try {
+        coefficients.blocks.assign(numBlocks, CoefficientBlock());
+        coefficients.lastIndices.assign(numBlocks, 0);
+    }
+    catch (const std::bad_alloc&) {
+        JPG_LOG(LogLevel::Error, "Error - memory error");
+        return false;
+    }
+    return true;
+}
+
+
+//decode the coefficients of every component, coefficients has to hold one entry per component
+//scans are decoded in order, progressive ones refine the coefficients left by the earlier ones
+//numThreads = 0 uses one thread of workers per hardware thread. only the MCU rows [firstMCURow, lastMCURow) are
+//guaranteed to be decoded, the coefficients of other rows may be left at 0
+bool decodeHuffmanData(Header* const header, ComponentCoefficients* const coefficients, WorkerPool& workers, uint numThreads = 0,
+                       const uint firstMCURow = 0, const uint lastMCURow = UINT_MAX){
+    JPG_TIME(entropySeconds);
+    for (uint j = 0; j < header->numComponents; ++j) {
+        coefficients[j].blocksWide = header->mcuWidth * header->colorComponents[j].horizontalSamplingFactor;
+        coefficients[j].blocksHigh = header->mcuHeight * header->colorComponents[j].verticalSamplingFactor;
+        coefficients[j].firstRow = 0;
+        if (!clearCoefficients(coefficients[j])) {
+            return false;
+        }
+    }
+
+    for (Scan& scan : header->scans) {
+        buildScanTables(scan);
+        if (!decodeScan(header, scan, coefficients, workers, numThreads, firstMCURow, lastMCURow)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//true when the image is a single sequential scan that can be decoded one MCU row at a time
+bool canDecodeMCURows(const Header* const header) {
+    return header->frameType == SOF0 && header->scans.size() == 1 && header->scans[0].numComponents == header->numComponents;
+}
+
+//decode the MCUs in rows [firstMCURow, lastMCURow) and columns [firstMCUColumn, lastMCUColumn) of a single-scan
+//sequential image one MCU row at a time, calling rowDecoded(mcuRow) after each. coefficients only ever hold one
+//MCU row and the huffman data is read in order, so restart intervals aren't parallel. MCUs outside the window
+//are skipped by jumping to the restart interval holding the next one needed or read past for their DC predictions
+bool decodeMCURows(Header* const header, ComponentCoefficients* const coefficients, const uint firstMCURow, const uint lastMCURow,
+                   const uint firstMCUColumn, const uint lastMCUColumn, const std::function<bool(uint)>& rowDecoded) {
+    for (uint j = 0; j < header->numComponents; ++j) {
+        coefficients[j].blocksWide = header->mcuWidth * header->colorComponents[j].horizontalSamplingFactor;
+        coefficients[j].blocksHigh = header->colorComponents[j].verticalSamplingFactor;
+        if (!clearCoefficients(coefficients[j])) {
+            return false;
+        }
+    }
+
+    Scan& scan = header->scans[0];
+    buildScanTables(scan);
+    const uint numMCUs = header->mcuWidth * header->mcuHeight;
+    const uint mcusPerInterval = scan.restartInterval != 0 ? scan.restartInterval : numMCUs;
+    const uint numIntervals = (numMCUs + mcusPerInterval - 1) / mcusPerInterval;
+    if (scan.restartOffsets.size() + 1 < numIntervals) {
+        JPG_LOG(LogLevel::Error, "Error - missing restart markers");
+        return false;
+    }
+
+    BitReader reader(nullptr, 0);
+    int previousDCs[3] = {0};
+    uint eobRun = 0;
+    //the next MCU the reader would decode
+    uint position = UINT_MAX;
+    //read on up to MCU to, storing the MCUs in target when it's given, a new reader starts at every restart interval
+    auto advance = [&](const uint to, ComponentCoefficients* const target) {
+        while (position < to) {
+            if (position % mcusPerInterval == 0) {
+                std::size_t start = 0;
+                std::size_t end = 0;
+                intervalRange(scan, position / mcusPerInterval, numIntervals, start, end);
+                reader = BitReader(scan.huffmanData + start, end - start);
+                previousDCs[0] = previousDCs[1] = previousDCs[2] = 0;
+                JPG_COUNT(restartIntervals, 1);
+            }
+            const uint intervalEnd = (position / mcusPerInterval + 1) * mcusPerInterval;
+            const uint last = intervalEnd < to ? intervalEnd : to;
+            if (!decodeUnits(header, scan, target, header->mcuWidth, position, last, reader, previousDCs, eobRun)) {
+                return false;
+            }
+            position = last;
+        }
+        return true;
+    };
+
+    for (uint mcuRow = firstMCURow; mcuRow < lastMCURow; ++mcuRow) {
+        for (uint j = 0; j < header->numComponents; ++j) {
+            coefficients[j].firstRow = mcuRow * header->colorComponents[j].verticalSamplingFactor;
+        }
+        const uint first = mcuRow * header->mcuWidth + firstMCUColumn;
+        const uint last = mcuRow * header->mcuWidth + lastMCUColumn;
+        if (position == UINT_MAX || first / mcusPerInterval > position / mcusPerInterval) {
+            position = first / mcusPerInterval * mcusPerInterval;
+        }
+        {
+            JPG_TIME(entropySeconds);
+            if (!advance(first, nullptr) || !advance(last, coefficients)) {
+                return false;
+            }
+        }
+        if (!rowDecoded(mcuRow)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//fixed-point inverse DCT, the LLM algorithm used by the IJG "islow" IDCT
+//multipliers carry CONST_BITS of fraction, the first pass keeps PASS1_BITS extra precision for the second
+const int IDCT_CONST_BITS = 13;
+const int IDCT_PASS1_BITS = 2;
+
+const int FIX_0_298631336 = 2446;
+const int FIX_0_390180644 = 3196;
+const int FIX_0_541196100 = 4433;
+const int FIX_0_765366865 = 6270;
+const int FIX_0_899976223 = 7373;
+const int FIX_1_175875602 = 9633;
+const int FIX_1_501321110 = 12299;
+const int FIX_1_847759065 = 15137;
+const int FIX_1_961570560 = 16069;
+const int FIX_2_053119869 = 16819;
+const int FIX_2_562915447 = 20995;
+const int FIX_3_072711026 = 25172;
+
+//one 8-point pass shared by every IDCT kernel, each kernel defines ADD, SUB, MUL (by a constant)
+//and SHL for its own lane type. inputs must be plain variables, outputs are left unscaled
+#define IDCT_1D(T, i0, i1, i2, i3, i4, i5, i6, i7, o0, o1, o2, o3, o4, o5, o6, o7) { \
+    /* even part */ \
+    T z1 = MUL(ADD(i2, i6), FIX_0_541196100); \
+    T tmp2 = ADD(z1, MUL(i6, -FIX_1_847759065)); \
+    T tmp3 = ADD(z1, MUL(i2, FIX_0_765366865)); \
+    T tmp0 = SHL(ADD(i0, i4), IDCT_CONST_BITS); \
+    T tmp1 = SHL(SUB(i0, i4), IDCT_CONST_BITS); \
+    const T tmp10 = ADD(tmp0, tmp3); \
+    const T tmp13 = SUB(tmp0, tmp3); \
+    const T tmp11 = ADD(tmp1, tmp2); \
+    const T tmp12 = SUB(tmp1, tmp2); \
+    /* odd part */ \
+    z1 = ADD(i7, i1); \
+    T z2 = ADD(i5, i3); \
+    T z3 = ADD(i7, i3); \
+    T z4 = ADD(i5, i1); \
+    const T z5 = MUL(ADD(z3, z4), FIX_1_175875602); \
+    tmp0 = MUL(i7, FIX_0_298631336); \
+    tmp1 = MUL(i5, FIX_2_053119869); \
+    tmp2 = MUL(i3, FIX_3_072711026); \
+    tmp3 = MUL(i1, FIX_1_501321110); \
+    z1 = MUL(z1, -FIX_0_899976223); \
+    z2 = MUL(z2, -FIX_2_562915447); \
+    z3 = ADD(MUL(z3, -FIX_1_961570560), z5); \
+    z4 = ADD(MUL(z4, -FIX_0_390180644), z5); \
+    tmp0 = ADD(tmp0, ADD(z1, z3)); \
+    tmp1 = ADD(tmp1, ADD(z2, z4)); \
+    tmp2 = ADD(tmp2, ADD(z2, z3)); \
+    tmp3 = ADD(tmp3, ADD(z1, z4)); \
+    o0 = ADD(tmp10, tmp3); \
+    o7 = SUB(tmp10, tmp3); \
+    o1 = ADD(tmp11, tmp2); \
+    o6 = SUB(tmp11, tmp2); \
+    o2 = ADD(tmp12, tmp1); \
+    o5 = SUB(tmp12, tmp1); \
+    o3 = ADD(tmp13, tmp0); \
+    o4 = SUB(tmp13, tmp0); \
+}
+
+//IDCT_1D for inputs i4..i7 all zero, with the terms they would have added left out
+//so it gives exactly the same outputs with about half the multiplies
+#define IDCT_1D_4(T, i0, i1, i2, i3, o0, o1, o2, o3, o4, o5, o6, o7) { \
+    /* even part */ \
+    const T z1 = MUL(i2, FIX_0_541196100); \
+    const T tmp3 = ADD(z1, MUL(i2, FIX_0_765366865)); \
+    const T tmp0 = SHL(i0, IDCT_CONST_BITS); \
+    const T tmp10 = ADD(tmp0, tmp3); \
+    const T tmp13 = SUB(tmp0, tmp3); \
+    const T tmp11 = ADD(tmp0, z1); \
+    const T tmp12 = SUB(tmp0, z1); \
+    /* odd part */ \
+    const T z5 = MUL(ADD(i3, i1), FIX_1_175875602); \
+    const T z1odd = MUL(i1, -FIX_0_899976223); \
+    const T z2 = MUL(i3, -FIX_2_562915447); \
+    const T z3 = ADD(MUL(i3, -FIX_1_961570560), z5); \
+    const T z4 = ADD(MUL(i1, -FIX_0_390180644), z5); \
+    const T odd0 = ADD(z1odd, z3); \
+    const T odd1 = ADD(z2, z4); \
+    const T odd2 = ADD(MUL(i3, FIX_3_072711026), ADD(z2, z3)); \
+    const T odd3 = ADD(MUL(i1, FIX_1_501321110), ADD(z1odd, z4)); \
+    o0 = ADD(tmp10, odd3); \
+    o7 = SUB(tmp10, odd3); \
+    o1 = ADD(tmp11, odd2); \
+    o6 = SUB(tmp11, odd2); \
+    o2 = ADD(tmp12, odd1); \
+    o5 = SUB(tmp12, odd1); \
+    o3 = ADD(tmp13, odd0); \
+    o4 = SUB(tmp13, odd0); \
+}
+
+//rounding terms of both passes, the second one also adds the +128 level shift
+const int IDCT_PASS1_SHIFT = IDCT_CONST_BITS - IDCT_PASS1_BITS;
+const int IDCT_PASS2_SHIFT = IDCT_CONST_BITS + IDCT_PASS1_BITS + 3;
+const int IDCT_PASS1_ROUND = 1 << (IDCT_PASS1_SHIFT - 1);
+const int IDCT_PASS2_ROUND = (1 << (IDCT_PASS2_SHIFT - 1)) + (128 << IDCT_PASS2_SHIFT);
+
+
+#define ADD(a, b) ((a) + (b))
+#define SUB(a, b) ((a) - (b))
+#define MUL(a, c) ((a) * (c))
+#define SHL(a, n) ((a) * (1 << (n)))
+
+//portable kernel, dequantizes and transforms one block of coefficients in natural order
+//into 8-bit samples, stride is the distance between output rows
+//sparse blocks only have coefficients in their top left 4x4 corner
+void idctBlockScalar(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride, const bool sparse) {
+    int workspace[64];
+    //columns, dequantizing on the way in. the right half of a sparse block stays zero
+    for (uint c = 0; c < 8; ++c) {
+        int in[8];
+        int out[8];
+        if (sparse) {
+            if (c >= 4) {
+                for (uint r = 0; r < 8; ++r) {
+                    workspace[r * 8 + c] = 0;
+                }
+                continue;
+            }
+            for (uint r = 0; r < 4; ++r) {
+                in[r] = coefficients[r * 8 + c] * (int)quantizationTable[r * 8 + c];
+            }
+            IDCT_1D_4(int, in[0], in[1], in[2], in[3],
+                           out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+        }
+        else {
+            for (uint r = 0; r < 8; ++r) {
+                in[r] = coefficients[r * 8 + c] * (int)quantizationTable[r * 8 + c];
+            }
+            IDCT_1D(int, in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+                         out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+        }
+        for (uint r = 0; r < 8; ++r) {
+            workspace[r * 8 + c] = (out[r] + IDCT_PASS1_ROUND) >> IDCT_PASS1_SHIFT;
+        }
+    }
+    //rows
+    for (uint r = 0; r < 8; ++r) {
+        const int* const in = workspace + r * 8;
+        int out[8];
+        if (sparse) {
+            IDCT_1D_4(int, in[0], in[1], in[2], in[3],
+                           out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+        }
+        else {
+            IDCT_1D(int, in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+                         out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+        }
+        for (uint c = 0; c < 8; ++c) {
+            const int sample = (out[c] + IDCT_PASS2_ROUND) >> IDCT_PASS2_SHIFT;
+            output[r * stride + c] = sample < 0 ? 0 : (sample > 255 ? 255 : sample);
+        }
+    }
+}
+
+#undef ADD
+#undef SUB
+#undef MUL
+#undef SHL
+
+
+#if defined(__SSE2__)
+
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define SUB(a, b) _mm256_sub_epi32(a, b)
+#define MUL(a, c) _mm256_mullo_epi32(a, _mm256_set1_epi32(c))
+#define SHL(a, n) _mm256_slli_epi32(a, n)
+
+JPG_TARGET("avx2") static inline void transpose8x8(__m256i* const r) {
+    const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+//one row of the block per register, both passes work on all 8 columns/rows at once
+//a sparse block has zero rows 4-7 going into the first pass and zero columns 4-7 going into the second
+JPG_TARGET("avx2") void idctBlockAVX2(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride, const bool sparse) {
+    __m256i r[8];
+    __m256i o[8];
+    const uint numRows = sparse ? 4 : 8;
+    for (uint i = 0; i < numRows; ++i) {
+        r[i] = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(coefficients + i * 8))),
+                                  _mm256_loadu_si256((const __m256i*)(quantizationTable + i * 8)));
+    }
+    if (sparse) {
+        IDCT_1D_4(__m256i, r[0], r[1], r[2], r[3],
+                           o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+    }
+    else {
+        IDCT_1D(__m256i, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7],
+                         o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+    }
+    const __m256i round1 = _mm256_set1_epi32(IDCT_PASS1_ROUND);
+    for (uint i = 0; i < 8; ++i) {
+        r[i] = _mm256_srai_epi32(_mm256_add_epi32(o[i], round1), IDCT_PASS1_SHIFT);
+    }
+
+    transpose8x8(r);
+    if (sparse) {
+        IDCT_1D_4(__m256i, r[0], r[1], r[2], r[3],
+                           o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+    }
+    else {
+        IDCT_1D(__m256i, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7],
+                         o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+    }
+    const __m256i round2 = _mm256_set1_epi32(IDCT_PASS2_ROUND);
+    for (uint i = 0; i < 8; ++i) {
+        o[i] = _mm256_srai_epi32(_mm256_add_epi32(o[i], round2), IDCT_PASS2_SHIFT);
+    }
+    transpose8x8(o);
+    //the saturating packs clamp to [0, 255]
+    for (uint i = 0; i < 8; ++i) {
+        const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(o[i]), _mm256_extracti128_si256(o[i], 1));
+        _mm_storel_epi64((__m128i*)(output + i * stride), _mm_packus_epi16(words, words));
+    }
+}
+
+#undef ADD
+#undef SUB
+#undef MUL
+#undef SHL
+
+#endif
+
+#if defined(__SSE2__)
+
+//SSE2 has no 32-bit mullo, build it from two 32x32->64 multiplies
+static inline __m128i mullo32(const __m128i a, const __m128i b) {
+#if defined(__SSE4_1__)
+    return _mm_mullo_epi32(a, b);
+#else
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+
+static inline void transpose4x4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+    const __m128i t0 = _mm_unpacklo_epi32(a, b);
+    const __m128i t1 = _mm_unpacklo_epi32(c, d);
+    const __m128i t2 = _mm_unpackhi_epi32(a, b);
+    const __m128i t3 = _mm_unpackhi_epi32(c, d);
+    a = _mm_unpacklo_epi64(t0, t1);
+    b = _mm_unpackhi_epi64(t0, t1);
+    c = _mm_unpacklo_epi64(t2, t3);
+    d = _mm_unpackhi_epi64(t2, t3);
+}
+
+//l[i] holds columns 0-3 of row i and h[i] columns 4-7, transpose the 8x8 block in place
+static inline void transpose8x8(__m128i* const l, __m128i* const h) {
+    transpose4x4(l[0], l[1], l[2], l[3]);
+    transpose4x4(l[4], l[5], l[6], l[7]);
+    transpose4x4(h[0], h[1], h[2], h[3]);
+    transpose4x4(h[4], h[5], h[6], h[7]);
+    for (uint i = 0; i < 4; ++i) {
+        const __m128i swap = h[i];
+        h[i] = l[i + 4];
+        l[i + 4] = swap;
+    }
+}
+
+#define ADD(a, b) _mm_add_epi32(a, b)
+#define SUB(a, b) _mm_sub_epi32(a, b)
+#define MUL(a, c) mullo32(a, _mm_set1_epi32(c))
+#define SHL(a, n) _mm_slli_epi32(a, n)
+
+//sparse blocks only need the left halves in the first pass, the right halves come out as zeros
+//and the second pass only has 4 nonzero inputs in either half
+static inline void idctBlockSSE2Sparse(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride) {
+    __m128i l[8];
+    __m128i h[8];
+    for (uint i = 0; i < 4; ++i) {
+        const __m128i row = _mm_loadl_epi64((const __m128i*)(coefficients + i * 8));
+        l[i] = mullo32(_mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16),
+                       _mm_loadu_si128((const __m128i*)(quantizationTable + i * 8)));
+    }
+    IDCT_1D_4(__m128i, l[0], l[1], l[2], l[3],
+                       l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    const __m128i round1 = _mm_set1_epi32(IDCT_PASS1_ROUND);
+    for (uint i = 0; i < 8; ++i) {
+        l[i] = _mm_srai_epi32(_mm_add_epi32(l[i], round1), IDCT_PASS1_SHIFT);
+    }
+
+    //transposing with zero right halves, rows 4-7 of the result are zero
+    transpose4x4(l[0], l[1], l[2], l[3]);
+    transpose4x4(l[4], l[5], l[6], l[7]);
+    for (uint i = 0; i < 4; ++i) {
+        h[i] = l[i + 4];
+    }
+    const __m128i round2 = _mm_set1_epi32(IDCT_PASS2_ROUND);
+    IDCT_1D_4(__m128i, l[0], l[1], l[2], l[3],
+                       l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    IDCT_1D_4(__m128i, h[0], h[1], h[2], h[3],
+                       h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+    for (uint i = 0; i < 8; ++i) {
+        l[i] = _mm_srai_epi32(_mm_add_epi32(l[i], round2), IDCT_PASS2_SHIFT);
+        h[i] = _mm_srai_epi32(_mm_add_epi32(h[i], round2), IDCT_PASS2_SHIFT);
+    }
+    transpose8x8(l, h);
+    for (uint i = 0; i < 8; ++i) {
+        const __m128i words = _mm_packs_epi32(l[i], h[i]);
+        _mm_storel_epi64((__m128i*)(output + i * stride), _mm_packus_epi16(words, words));
+    }
+}
+
+//same as the AVX2 kernel with each row split into two halves of 4 lanes
+void idctBlockSSE2(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride, const bool sparse) {
+    if (sparse) {
+        idctBlockSSE2Sparse(coefficients, quantizationTable, output, stride);
+        return;
+    }
+    __m128i l[8];
+    __m128i h[8];
+    for (uint i = 0; i < 8; ++i) {
+        //sign extend the 16-bit coefficients by unpacking each with itself and shifting back down
+        const __m128i row = _mm_loadu_si128((const __m128i*)(coefficients + i * 8));
+        l[i] = mullo32(_mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16),
+                       _mm_loadu_si128((const __m128i*)(quantizationTable + i * 8)));
+        h[i] = mullo32(_mm_srai_epi32(_mm_unpackhi_epi16(row, row), 16),
+                       _mm_loadu_si128((const __m128i*)(quantizationTable + i * 8 + 4)));
+    }
+    const __m128i round1 = _mm_set1_epi32(IDCT_PASS1_ROUND);
+    IDCT_1D(__m128i, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7],
+                     l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    IDCT_1D(__m128i, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                     h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+    for (uint i = 0; i < 8; ++i) {
+        l[i] = _mm_srai_epi32(_mm_add_epi32(l[i], round1), IDCT_PASS1_SHIFT);
+        h[i] = _mm_srai_epi32(_mm_add_epi32(h[i], round1), IDCT_PASS1_SHIFT);
+    }
+
+    transpose8x8(l, h);
+    const __m128i round2 = _mm_set1_epi32(IDCT_PASS2_ROUND);
+    IDCT_1D(__m128i, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7],
+                     l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    IDCT_1D(__m128i, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                     h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+    for (uint i = 0; i < 8; ++i) {
+        l[i] = _mm_srai_epi32(_mm_add_epi32(l[i], round2), IDCT_PASS2_SHIFT);
+        h[i] = _mm_srai_epi32(_mm_add_epi32(h[i], round2), IDCT_PASS2_SHIFT);
+    }
+    transpose8x8(l, h);
+    //the saturating packs clamp to [0, 255]
+    for (uint i = 0; i < 8; ++i) {
+        const __m128i words = _mm_packs_epi32(l[i], h[i]);
+        _mm_storel_epi64((__m128i*)(output + i * stride), _mm_packus_epi16(words, words));
+    }
+}
+
+#undef ADD
+#undef SUB
+#undef MUL
+#undef SHL
+
+#endif
+
+
+//reduced size inverse DCTs for scaled decoding, the ones of the IJG library (jidctred.c)
+//they only look at the coefficients that matter for the smaller output
+const int FIX_0_211164243 = 1730;
+const int FIX_0_509795579 = 4176;
+const int FIX_0_601344887 = 4926;
+const int FIX_0_720959822 = 5906;
+const int FIX_0_850430095 = 6967;
+const int FIX_1_061594337 = 8697;
+const int FIX_1_272758580 = 10426;
+const int FIX_1_451774981 = 11893;
+const int FIX_2_172734803 = 17799;
+const int FIX_3_624509785 = 29692;
+
+static inline byte clampSample(const int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int descale(const int value, const int shift) {
+    return (value + (1 << (shift - 1))) >> shift;
+}
+
+//4x4 output, column 4 and row 4 don't contribute
+void idctBlock4x4(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride) {
+    int workspace[8 * 4];
+    for (uint c = 0; c < 8; ++c) {
+        if (c == 4) {
+            continue;
+        }
+        int in[8];
+        for (uint r = 0; r < 8; ++r) {
+            in[r] = coefficients[r * 8 + c] * (int)quantizationTable[r * 8 + c];
+        }
+        const int tmp0 = in[0] * (1 << (IDCT_CONST_BITS + 1));
+        const int tmp2 = in[2] * FIX_1_847759065 - in[6] * FIX_0_765366865;
+        const int tmp10 = tmp0 + tmp2;
+        const int tmp12 = tmp0 - tmp2;
+        const int odd0 = -in[7] * FIX_0_211164243 + in[5] * FIX_1_451774981 - in[3] * FIX_2_172734803 + in[1] * FIX_1_061594337;
+        const int odd2 = -in[7] * FIX_0_509795579 - in[5] * FIX_0_601344887 + in[3] * FIX_0_899976223 + in[1] * FIX_2_562915447;
+        workspace[0 * 8 + c] = descale(tmp10 + odd2, IDCT_CONST_BITS - IDCT_PASS1_BITS + 1);
+        workspace[3 * 8 + c] = descale(tmp10 - odd2, IDCT_CONST_BITS - IDCT_PASS1_BITS + 1);
+        workspace[1 * 8 + c] = descale(tmp12 + odd0, IDCT_CONST_BITS - IDCT_PASS1_BITS + 1);
+        workspace[2 * 8 + c] = descale(tmp12 - odd0, IDCT_CONST_BITS - IDCT_PASS1_BITS + 1);
+    }
+    const int shift = IDCT_CONST_BITS + IDCT_PASS1_BITS + 3 + 1;
+    for (uint r = 0; r < 4; ++r) {
+        const int* const in = workspace + r * 8;
+        const int tmp0 = in[0] * (1 << (IDCT_CONST_BITS + 1));
+        const int tmp2 = in[2] * FIX_1_847759065 - in[6] * FIX_0_765366865;
+        const int tmp10 = tmp0 + tmp2;
+        const int tmp12 = tmp0 - tmp2;
+        const int odd0 = -in[7] * FIX_0_211164243 + in[5] * FIX_1_451774981 - in[3] * FIX_2_172734803 + in[1] * FIX_1_061594337;
+        const int odd2 = -in[7] * FIX_0_509795579 - in[5] * FIX_0_601344887 + in[3] * FIX_0_899976223 + in[1] * FIX_2_562915447;
+        byte* const out = output + r * stride;
+        out[0] = clampSample(descale(tmp10 + odd2, shift) + 128);
+        out[3] = clampSample(descale(tmp10 - odd2, shift) + 128);
+        out[1] = clampSample(descale(tmp12 + odd0, shift) + 128);
+        out[2] = clampSample(descale(tmp12 - odd0, shift) + 128);
+    }
+}
+
+//2x2 output, only the DC and odd coefficients of each column and row contribute
+void idctBlock2x2(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride) {
+    int workspace[8 * 2];
+    for (uint c = 0; c < 8; c += (c == 0 ? 1 : 2)) {
+        int in[8];
+        for (uint r = 0; r < 8; r += (r == 0 ? 1 : 2)) {
+            in[r] = coefficients[r * 8 + c] * (int)quantizationTable[r * 8 + c];
+        }
+        const int tmp10 = in[0] * (1 << (IDCT_CONST_BITS + 2));
+        const int tmp0 = -in[7] * FIX_0_720959822 + in[5] * FIX_0_850430095 - in[3] * FIX_1_272758580 + in[1] * FIX_3_624509785;
+        workspace[0 * 8 + c] = descale(tmp10 + tmp0, IDCT_CONST_BITS - IDCT_PASS1_BITS + 2);
+        workspace[1 * 8 + c] = descale(tmp10 - tmp0, IDCT_CONST_BITS - IDCT_PASS1_BITS + 2);
+    }
+    const int shift = IDCT_CONST_BITS + IDCT_PASS1_BITS + 3 + 2;
+    for (uint r = 0; r < 2; ++r) {
+        const int* const in = workspace + r * 8;
+        const int tmp10 = in[0] * (1 << (IDCT_CONST_BITS + 2));
+        const int tmp0 = -in[7] * FIX_0_720959822 + in[5] * FIX_0_850430095 - in[3] * FIX_1_272758580 + in[1] * FIX_3_624509785;
+        output[r * stride] = clampSample(descale(tmp10 + tmp0, shift) + 128);
+        output[r * stride + 1] = clampSample(descale(tmp10 - tmp0, shift) + 128);
+    }
+}
+
+//1x1 output is just the DC coefficient, no transform at all
+void idctBlock1x1(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint) {
+    output[0] = clampSample(descale(coefficients[0] * (int)quantizationTable[0], 3) + 128);
+}
+
+//a block with only a DC coefficient is flat at any size, every kernel gives this same value for it
+void idctBlockDC(const int16_t* const coefficients, const uint* const quantizationTable, byte* const output, const uint stride, const uint blockSize) {
+    const byte sample = clampSample(descale(coefficients[0] * (int)quantizationTable[0], 3) + 128);
+    for (uint r = 0; r < blockSize; ++r) {
+        std::memset(output + r * stride, sample, blockSize);
+    }
+}
+
+//the last zigzag index that still lies in the top left 4x4 corner of a block
+const uint SPARSE_LAST_INDEX = 9;
+
+
+//dequantize and inverse DCT the blocks of MCU columns [firstMCUColumn, lastMCUColumn) in one MCU row
+//of every component into its 8-bit plane
+void inverseDCTRow(const Header* const header, ComponentCoefficients* const coefficients, const uint mcuRow,
+                   const uint firstMCUColumn, const uint lastMCUColumn, ComponentPlane* const planes) {
+    for (uint j = 0; j < header->numComponents; ++j) {
+        ComponentCoefficients& component = coefficients[j];
+        const uint* const quantizationTable = header->quantizationTables[header->colorComponents[j].quantizationTableID].table;
+        const uint verticalSamplingFactor = header->colorComponents[j].verticalSamplingFactor;
+        const uint horizontalSamplingFactor = header->colorComponents[j].horizontalSamplingFactor;
+        const uint blockSize = planes[j].blockSize;
+        const uint stride = planes[j].stride;
+        void (*const transform)(const int16_t*, const uint*, byte*, uint) =
+            blockSize == 4 ? idctBlock4x4 : (blockSize == 2 ? idctBlock2x2 : idctBlock1x1);
+        //the position of the last coefficient picks the cheapest kernel that gives the same samples
+        for (uint v = 0; v < verticalSamplingFactor; ++v) {
+            const uint y = mcuRow * verticalSamplingFactor + v;
+            byte* const output = planes[j].row(y * blockSize);
+            for (uint x = firstMCUColumn * horizontalSamplingFactor; x < lastMCUColumn * horizontalSamplingFactor; ++x) {
+                const uint lastIndex = component.lastIndex(y, x);
+                JPG_COUNT(blocks, 1);
+                JPG_COUNT(dcOnlyBlocks, lastIndex == 0 ? 1 : 0);
+                JPG_COUNT(sparseBlocks, lastIndex != 0 && lastIndex <= SPARSE_LAST_INDEX ? 1 : 0);
+                if (lastIndex == 0) {
+                    idctBlockDC(component.block(y, x), quantizationTable, output + x * blockSize, stride, blockSize);
+                }
+                else if (blockSize == 8) {
+                    kernels.idctBlock(component.block(y, x), quantizationTable, output + x * blockSize, stride, lastIndex <= SPARSE_LAST_INDEX);
+                }
+                else {
+                    transform(component.block(y, x), quantizationTable, output + x * blockSize, stride);
+                }
+            }
+        }
+    }
+}
+
+
+//YCbCr to RGB uses the IJG 16-bit fixed-point multipliers. the ones that don't fit in
+//a signed 16-bit value are split into an integer part and a remainder so the SIMD kernels
+//can use 16-bit multiply-adds and still give exactly the same result as the scalar code
+//  R = Y + 1.40200 Cr                 = Y + Cr + 0.40200 Cr
+//  G = Y - 0.34414 Cb - 0.71414 Cr    = Y - Cr - 0.34414 Cb + 0.28586 Cr
+//  B = Y + 1.77200 Cb                 = Y + 2 Cb - 0.22800 Cb
+const int CR_R_FRACTION = 26345;
+const int CB_G_FRACTION = -22554;
+const int CR_G_FRACTION = 18734;
+const int CB_B_FRACTION = -14942;
+
+uint pixelSize(const PixelFormat format) {
+    if (format == PixelFormat::Gray) {
+        return 1;
+    }
+    return (format == PixelFormat::RGBA || format == PixelFormat::BGRA) ? 4 : 3;
+}
+
+static inline void storePixel(byte* const output, const int r, const int g, const int b, const PixelFormat format) {
+    const bool bgr = format == PixelFormat::BGR || format == PixelFormat::BGRA;
+    output[0] = clampSample(bgr ? b : r);
+    output[1] = clampSample(g);
+    output[2] = clampSample(bgr ? r : b);
+    if (pixelSize(format) == 4) {
+        output[3] = 255;
+    }
+}
+
+
+#if defined(__SSE2__)
+
+//interleave 16 pixels worth of R, G and B bytes into the output format
+static inline void storePixels16(__m128i r, const __m128i g, __m128i b, byte* const output, const PixelFormat format) {
+    if (format == PixelFormat::BGR || format == PixelFormat::BGRA) {
+        const __m128i swap = r;
+        r = b;
+        b = swap;
+    }
+    if (pixelSize(format) == 4) {
+        const __m128i a = _mm_set1_epi8(-1);
+        const __m128i rgLow = _mm_unpacklo_epi8(r, g);
+        const __m128i rgHigh = _mm_unpackhi_epi8(r, g);
+        const __m128i baLow = _mm_unpacklo_epi8(b, a);
+        const __m128i baHigh = _mm_unpackhi_epi8(b, a);
+        _mm_storeu_si128((__m128i*)(output + 0), _mm_unpacklo_epi16(rgLow, baLow));
+        _mm_storeu_si128((__m128i*)(output + 16), _mm_unpackhi_epi16(rgLow, baLow));
+        _mm_storeu_si128((__m128i*)(output + 32), _mm_unpacklo_epi16(rgHigh, baHigh));
+        _mm_storeu_si128((__m128i*)(output + 48), _mm_unpackhi_epi16(rgHigh, baHigh));
+        return;
+    }
+    //no byte shuffle before SSSE3, interleave the converted bytes from the stack
+    alignas(16) byte rs[16];
+    alignas(16) byte gs[16];
+    alignas(16) byte bs[16];
+    _mm_store_si128((__m128i*)rs, r);
+    _mm_store_si128((__m128i*)gs, g);
+    _mm_store_si128((__m128i*)bs, b);
+    for (uint i = 0; i < 16; ++i) {
+        output[i * 3 + 0] = rs[i];
+        output[i * 3 + 1] = gs[i];
+        output[i * 3 + 2] = bs[i];
+    }
+}
+
+//SSSE3 builds each 16-byte block of 3-byte pixels with byte shuffles, 4-byte pixels are the same as SSE2
+JPG_TARGET("ssse3") static inline void storePixels16SSSE3(__m128i r, const __m128i g, __m128i b, byte* const output, const PixelFormat format) {
+    if (pixelSize(format) == 4) {
+        storePixels16(r, g, b, output, format);
+        return;
+    }
+    if (format == PixelFormat::BGR) {
+        const __m128i swap = r;
+        r = b;
+        b = swap;
+    }
+    //each 16-byte output block gathers its bytes from all three channels
+    const __m128i out0 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128)));
+    const __m128i out1 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128)));
+    const __m128i out2 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15)));
+    _mm_storeu_si128((__m128i*)(output + 0), out0);
+    _mm_storeu_si128((__m128i*)(output + 16), out1);
+    _mm_storeu_si128((__m128i*)(output + 32), out2);
+}
+
+//16 pixels per call, the whole computation is done in one 16-lane register per channel
+JPG_TARGET("avx2") static inline void YCbCrToRGB16AVX2(const byte* const y, const byte* const cb, const byte* const cr, __m128i& r, __m128i& g, __m128i& b) {
+    const __m256i center = _mm256_set1_epi16(128);
+    const __m256i round = _mm256_set1_epi32(1 << 15);
+    const __m256i rMultiplier = _mm256_set1_epi32((CR_R_FRACTION << 16) | 0);
+    const __m256i gMultiplier = _mm256_set1_epi32((CR_G_FRACTION << 16) | (CB_G_FRACTION & 0xFFFF));
+    const __m256i bMultiplier = _mm256_set1_epi32(CB_B_FRACTION & 0xFFFF);
+
+    const __m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)y));
+    const __m256i cb16 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)cb)), center);
+    const __m256i cr16 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)cr)), center);
+    //(cb, cr) pairs, unpacking and packing within each 128-bit lane keeps the pixel order
+    const __m256i low = _mm256_unpacklo_epi16(cb16, cr16);
+    const __m256i high = _mm256_unpackhi_epi16(cb16, cr16);
+
+    #define FRACTION(multiplier) _mm256_packs_epi32( \
+        _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(low, multiplier), round), 16), \
+        _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(high, multiplier), round), 16))
+    const __m256i r16 = _mm256_add_epi16(_mm256_add_epi16(y16, cr16), FRACTION(rMultiplier));
+    const __m256i g16 = _mm256_add_epi16(_mm256_sub_epi16(y16, cr16), FRACTION(gMultiplier));
+    const __m256i b16 = _mm256_add_epi16(_mm256_add_epi16(y16, _mm256_add_epi16(cb16, cb16)), FRACTION(bMultiplier));
+    #undef FRACTION
+
+    //saturating packs clamp to [0, 255]
+    r = _mm_packus_epi16(_mm256_castsi256_si128(r16), _mm256_extracti128_si256(r16, 1));
+    g = _mm_packus_epi16(_mm256_castsi256_si128(g16), _mm256_extracti128_si256(g16, 1));
+    b = _mm_packus_epi16(_mm256_castsi256_si128(b16), _mm256_extracti128_si256(b16, 1));
+}
+
+//16 pixels per call as two halves of 8 16-bit lanes
+static inline void YCbCrToRGB16SSE2(const byte* const y, const byte* const cb, const byte* const cr, __m128i& r, __m128i& g, __m128i& b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i center = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(1 << 15);
+    const __m128i rMultiplier = _mm_set1_epi32((CR_R_FRACTION << 16) | 0);
+    const __m128i gMultiplier = _mm_set1_epi32((CR_G_FRACTION << 16) | (CB_G_FRACTION & 0xFFFF));
+    const __m128i bMultiplier = _mm_set1_epi32(CB_B_FRACTION & 0xFFFF);
+
+    const __m128i yBytes = _mm_loadu_si128((const __m128i*)y);
+    const __m128i cbBytes = _mm_loadu_si128((const __m128i*)cb);
+    const __m128i crBytes = _mm_loadu_si128((const __m128i*)cr);
+    __m128i r16[2];
+    __m128i g16[2];
+    __m128i b16[2];
+    for (uint half = 0; half < 2; ++half) {
+        const __m128i y16 = half == 0 ? _mm_unpacklo_epi8(yBytes, zero) : _mm_unpackhi_epi8(yBytes, zero);
+        const __m128i cb16 = _mm_sub_epi16(half == 0 ? _mm_unpacklo_epi8(cbBytes, zero) : _mm_unpackhi_epi8(cbBytes, zero), center);
+        const __m128i cr16 = _mm_sub_epi16(half == 0 ? _mm_unpacklo_epi8(crBytes, zero) : _mm_unpackhi_epi8(crBytes, zero), center);
+        //(cb, cr) pairs for the 16-bit multiply-adds
+        const __m128i low = _mm_unpacklo_epi16(cb16, cr16);
+        const __m128i high = _mm_unpackhi_epi16(cb16, cr16);
+
+        #define FRACTION(multiplier) _mm_packs_epi32( \
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(low, multiplier), round), 16), \
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(high, multiplier), round), 16))
+        r16[half] = _mm_add_epi16(_mm_add_epi16(y16, cr16), FRACTION(rMultiplier));
+        g16[half] = _mm_add_epi16(_mm_sub_epi16(y16, cr16), FRACTION(gMultiplier));
+        b16[half] = _mm_add_epi16(_mm_add_epi16(y16, _mm_add_epi16(cb16, cb16)), FRACTION(bMultiplier));
+        #undef FRACTION
+    }
+    //saturating packs clamp to [0, 255]
+    r = _mm_packus_epi16(r16[0], r16[1]);
+    g = _mm_packus_epi16(g16[0], g16[1]);
+    b = _mm_packus_epi16(b16[0], b16[1]);
+}
+
+#endif
+
+
+//convert pixels [x, width) of a row of Y, Cb and Cr samples, all of them for the scalar kernel
+//and the ones past the last full group of 16 for the others
+static inline void YCbCrToPixelsTail(const byte* const y, const byte* const cb, const byte* const cr, byte* const output,
+                                     uint x, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    for (; x < width; ++x) {
+        const int cbValue = cb[x] - 128;
+        const int crValue = cr[x] - 128;
+        const int r = y[x] + crValue + ((CR_R_FRACTION * crValue + 32768) >> 16);
+        const int g = y[x] - crValue + ((CB_G_FRACTION * cbValue + CR_G_FRACTION * crValue + 32768) >> 16);
+        const int b = y[x] + 2 * cbValue + ((CB_B_FRACTION * cbValue + 32768) >> 16);
+        storePixel(output + x * size, r, g, b, format);
+    }
+}
+
+//convert one row of Y, Cb and Cr samples to interleaved pixels in a single pass
+void YCbCrToPixelsScalar(const byte* const y, const byte* const cb, const byte* const cr, byte* const output, const uint width, const PixelFormat format) {
+    YCbCrToPixelsTail(y, cb, cr, output, 0, width, format);
+}
+
+#if defined(__SSE2__)
+
+void YCbCrToPixelsSSE2(const byte* const y, const byte* const cb, const byte* const cr, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    uint x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r;
+        __m128i g;
+        __m128i b;
+        YCbCrToRGB16SSE2(y + x, cb + x, cr + x, r, g, b);
+        storePixels16(r, g, b, output + x * size, format);
+    }
+    YCbCrToPixelsTail(y, cb, cr, output, x, width, format);
+}
+
+JPG_TARGET("ssse3") void YCbCrToPixelsSSSE3(const byte* const y, const byte* const cb, const byte* const cr, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    uint x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r;
+        __m128i g;
+        __m128i b;
+        YCbCrToRGB16SSE2(y + x, cb + x, cr + x, r, g, b);
+        storePixels16SSSE3(r, g, b, output + x * size, format);
+    }
+    YCbCrToPixelsTail(y, cb, cr, output, x, width, format);
+}
+
+JPG_TARGET("avx2") void YCbCrToPixelsAVX2(const byte* const y, const byte* const cb, const byte* const cr, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    uint x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r;
+        __m128i g;
+        __m128i b;
+        YCbCrToRGB16AVX2(y + x, cb + x, cr + x, r, g, b);
+        storePixels16SSSE3(r, g, b, output + x * size, format);
+    }
+    YCbCrToPixelsTail(y, cb, cr, output, x, width, format);
+}
+
+#endif
+
+//grayscale rows just repeat Y in every channel
+void grayToPixelsScalar(const byte* const y, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    for (uint x = 0; x < width; ++x) {
+        storePixel(output + x * size, y[x], y[x], y[x], format);
+    }
+}
+
+#if defined(__SSE2__)
+
+void grayToPixelsSSE2(const byte* const y, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    uint x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i samples = _mm_loadu_si128((const __m128i*)(y + x));
+        storePixels16(samples, samples, samples, output + x * size, format);
+    }
+    grayToPixelsScalar(y + x, output + x * size, width - x, format);
+}
+
+//there's nothing to compute for gray, so AVX2 uses this one as well
+JPG_TARGET("ssse3") void grayToPixelsSSSE3(const byte* const y, byte* const output, const uint width, const PixelFormat format) {
+    const uint size = pixelSize(format);
+    uint x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i samples = _mm_loadu_si128((const __m128i*)(y + x));
+        storePixels16SSSE3(samples, samples, samples, output + x * size, format);
+    }
+    grayToPixelsScalar(y + x, output + x * size, width - x, format);
+}
+
+#endif
+
+
+//upsampling by 2 in either direction. the fancy filters weight the nearer sample by 3/4 and the
+//further one by 1/4, edges repeat the last real sample. results match the IJG fancy upsampling
+
+//the SSE2 loops are part of every x86 build and only step aside when the scalar kernels are forced
+
+//h2v1, each sample becomes two, blended with its left and right neighbours
+void upsampleH2V1Fancy(const byte* const input, byte* const output, const uint sampledWidth) {
+    const uint last = sampledWidth - 1;
+    output[0] = input[0];
+    output[1] = (input[0] * 3 + input[last == 0 ? 0 : 1] + 2) >> 2;
+    uint i = 1;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+    for (; kernels.level >= SIMDLevel::SSE2 && i + 8 <= last; i += 8) {
+        const __m128i previous = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(input + i - 1)), zero);
+        const __m128i current = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(input + i)), zero);
+        const __m128i next = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(input + i + 1)), zero);
+        const __m128i three = _mm_add_epi16(_mm_add_epi16(current, current), current);
+        const __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, previous), one), 2);
+        const __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, next), two), 2);
+        _mm_storeu_si128((__m128i*)(output + 2 * i), _mm_unpacklo_epi8(_mm_packus_epi16(even, even), _mm_packus_epi16(odd, odd)));
+    }
+#endif
+    for (; i < sampledWidth; ++i) {
+        const int three = input[i] * 3;
+        output[2 * i] = (three + input[i - 1] + 1) >> 2;
+        output[2 * i + 1] = (three + input[i == last ? last : i + 1] + 2) >> 2;
+    }
+}
+
+//h1v2, blend the nearer row with the further one, bias is 1 for the upper output row and 2 for the lower
+void upsampleH1V2Fancy(const byte* const nearRow, const byte* const farRow, byte* const output, const uint width, const int bias) {
+    uint x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i biasVector = _mm_set1_epi16(bias);
+    for (; kernels.level >= SIMDLevel::SSE2 && x + 16 <= width; x += 16) {
+        const __m128i nearBytes = _mm_loadu_si128((const __m128i*)(nearRow + x));
+        const __m128i farBytes = _mm_loadu_si128((const __m128i*)(farRow + x));
+        __m128i halves[2];
+        for (uint half = 0; half < 2; ++half) {
+            const __m128i near16 = half == 0 ? _mm_unpacklo_epi8(nearBytes, zero) : _mm_unpackhi_epi8(nearBytes, zero);
+            const __m128i far16 = half == 0 ? _mm_unpacklo_epi8(farBytes, zero) : _mm_unpackhi_epi8(farBytes, zero);
+            const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(near16, near16), near16), far16);
+            halves[half] = _mm_srli_epi16(_mm_add_epi16(sum, biasVector), 2);
+        }
+        _mm_storeu_si128((__m128i*)(output + x), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#endif
+    for (; x < width; ++x) {
+        output[x] = (nearRow[x] * 3 + farRow[x] + bias) >> 2;
+    }
+}
+
+//h2v2, vertical blend into column sums first, then the horizontal blend of the sums
+void upsampleH2V2Fancy(const byte* const nearRow, const byte* const farRow, byte* const output, const uint sampledWidth) {
+    const uint last = sampledWidth - 1;
+    auto columnSum = [nearRow, farRow](const uint i) {
+        return nearRow[i] * 3 + farRow[i];
+    };
+    output[0] = (columnSum(0) * 4 + 8) >> 4;
+    output[1] = (columnSum(0) * 3 + columnSum(last == 0 ? 0 : 1) + 7) >> 4;
+    uint i = 1;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i seven = _mm_set1_epi16(7);
+    const __m128i eight = _mm_set1_epi16(8);
+    for (; kernels.level >= SIMDLevel::SSE2 && i + 8 <= last; i += 8) {
+        __m128i sums[3];
+        for (uint k = 0; k < 3; ++k) {
+            const __m128i near16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(nearRow + i + k - 1)), zero);
+            const __m128i far16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(farRow + i + k - 1)), zero);
+            sums[k] = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(near16, near16), near16), far16);
+        }
+        const __m128i three = _mm_add_epi16(_mm_add_epi16(sums[1], sums[1]), sums[1]);
+        const __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, sums[0]), eight), 4);
+        const __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, sums[2]), seven), 4);
+        _mm_storeu_si128((__m128i*)(output + 2 * i), _mm_unpacklo_epi8(_mm_packus_epi16(even, even), _mm_packus_epi16(odd, odd)));
+    }
+#endif
+    for (; i < sampledWidth; ++i) {
+        const int three = columnSum(i) * 3;
+        output[2 * i] = (three + columnSum(i - 1) + 8) >> 4;
+        output[2 * i + 1] = (three + columnSum(i == last ? last : i + 1) + 7) >> 4;
+    }
+}
+
+//h2 replication, every sample is written twice
+void upsampleH2Replicate(const byte* const input, byte* const output, const uint sampledWidth) {
+    uint i = 0;
+#if defined(__SSE2__)
+    for (; kernels.level >= SIMDLevel::SSE2 && i + 16 <= sampledWidth; i += 16) {
+        const __m128i samples = _mm_loadu_si128((const __m128i*)(input + i));
+        _mm_storeu_si128((__m128i*)(output + 2 * i), _mm_unpacklo_epi8(samples, samples));
+        _mm_storeu_si128((__m128i*)(output + 2 * i + 16), _mm_unpackhi_epi8(samples, samples));
+    }
+#endif
+    for (; i < sampledWidth; ++i) {
+        output[2 * i] = input[i];
+        output[2 * i + 1] = input[i];
+    }
+}
+
+
+//the best SIMD level the cpu supports
+SIMDLevel detectSIMDLevel() {
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return SIMDLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMDLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SIMDLevel::SSSE3;
+    }
+    return SIMDLevel::SSE2;
+#else
+    return SIMDLevel::Scalar;
+#endif
+}
+
+//fill in the kernel table for level, capped at what the cpu supports. there are no AVX-512 kernels,
+//the 8x8 blocks and 16 pixel groups don't fill the wider registers, so AVX512 uses the AVX2 ones.
+//the table is shared by all decodes, change it only while nothing is decoding
+void setSIMDLevel(const SIMDLevel level) {
+    const SIMDLevel supported = detectSIMDLevel();
+    kernels.level = level < supported ? level : supported;
+    kernels.idctBlock = idctBlockScalar;
+    kernels.YCbCrToPixels = YCbCrToPixelsScalar;
+    kernels.grayToPixels = grayToPixelsScalar;
+#if defined(__SSE2__)
+    if (kernels.level >= SIMDLevel::SSE2) {
+        kernels.idctBlock = idctBlockSSE2;
+        kernels.YCbCrToPixels = YCbCrToPixelsSSE2;
+        kernels.grayToPixels = grayToPixelsSSE2;
+    }
+    if (kernels.level >= SIMDLevel::SSSE3) {
+        kernels.YCbCrToPixels = YCbCrToPixelsSSSE3;
+        kernels.grayToPixels = grayToPixelsSSSE3;
+    }
+    if (kernels.level >= SIMDLevel::AVX2) {
+        kernels.idctBlock = idctBlockAVX2;
+        kernels.YCbCrToPixels = YCbCrToPixelsAVX2;
+    }
+#endif
+}
+
+SIMDLevel simdLevel() {
+    return kernels.level;
+}
+
+const char* const simdLevelNames[] = { "scalar", "sse2", "ssse3", "avx2", "avx512" };
+
+const char* simdLevelName(const SIMDLevel level) {
+    return simdLevelNames[(uint)level];
+}
+
+//level from its name, false for a name that isn't one
+bool parseSIMDLevel(const std::string& name, SIMDLevel& level) {
+    for (uint l = 0; l <= (uint)SIMDLevel::AVX512; ++l) {
+        if (name == simdLevelNames[l]) {
+            level = (SIMDLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+//the kernels are picked before main runs, JPG_SIMD=scalar|sse2|ssse3|avx2|avx512 in the
+//environment lowers the level, mostly to test the narrower kernels on a wider cpu
+const bool kernelsSelected = [] {
+    SIMDLevel level = SIMDLevel::AVX512;
+    const char* const name = std::getenv("JPG_SIMD");
+    if (name != nullptr && !parseSIMDLevel(name, level)) {
+        JPG_LOG(LogLevel::Error, "Error - Unknown JPG_SIMD level: " << name);
+    }
+    setSIMDLevel(level);
+    return true;
+}();
+
+
+//columns [left, right) of row y of component j at the output resolution, upsampled on the fly
+//returns a pointer to the sample of column left, which is in the plane row itself when the component
+//isn't subsampled and otherwise in buffer, which needs room for right - left + 8 samples
+const byte* componentRow(const ComponentPlane* const planes, const uint j, const uint width, const uint height,
+                         const uint y, const uint left, const uint right, byte* const buffer, UpsamplingMode mode) {
+    const uint horizontalRatio = planes[j].horizontalRatio;
+    const uint verticalRatio = planes[j].verticalRatio;
+    //size of the component without the padding out to whole MCUs
+    const uint sampledWidth = (width + horizontalRatio - 1) / horizontalRatio;
+    const uint sampledHeight = (height + verticalRatio - 1) / verticalRatio;
+    //like the IJG library, rows too narrow to interpolate across are replicated
+    if (horizontalRatio == 2 && sampledWidth <= 2) {
+        mode = UpsamplingMode::Replicate;
+    }
+
+    //horizontal upsampling also takes the samples on either side of the columns, so they come out
+    //just like in a whole row. the outputs of those extra samples are dropped
+    uint first = left;
+    uint count = right - left;
+    if (horizontalRatio == 2) {
+        first = left / 2 > 0 ? left / 2 - 1 : 0;
+        const uint end = (right + 1) / 2 + 1 < sampledWidth ? (right + 1) / 2 + 1 : sampledWidth;
+        count = end - first;
+    }
+    const uint skipped = left - first * horizontalRatio;
+
+    const uint row = y / verticalRatio;
+    const byte* const nearRow = planes[j].row(row) + first;
+    if (horizontalRatio == 1 && (verticalRatio == 1 || mode == UpsamplingMode::Replicate)) {
+        return nearRow;
+    }
+    if (mode == UpsamplingMode::Replicate || verticalRatio == 1) {
+        if (mode == UpsamplingMode::Replicate) {
+            upsampleH2Replicate(nearRow, buffer, count);
+        }
+        else {
+            upsampleH2V1Fancy(nearRow, buffer, count);
+        }
+        return buffer + skipped;
+    }
+
+    //the further row is the one above for even output rows and the one below for odd rows
+    uint farRowIndex = row;
+    if (y % 2 == 0 && row > 0) {
+        farRowIndex = row - 1;
+    }
+    else if (y % 2 == 1 && row + 1 < sampledHeight) {
+        farRowIndex = row + 1;
+    }
+    const byte* const farRow = planes[j].row(farRowIndex) + first;
+    if (horizontalRatio == 1) {
+        upsampleH1V2Fancy(nearRow, farRow, buffer, count, y % 2 == 0 ? 1 : 2);
+    }
+    else {
+        upsampleH2V2Fancy(nearRow, farRow, buffer, count);
+    }
+    return buffer + skipped;
+}
+
+
+//convert columns [left, right) of the image rows [firstRow, lastRow) to pixels and pass them to callback
+//one at a time, numbered from top. the image is width x height at the output scale
+bool emitRows(const Header* const header, DecodeBuffers& buffers, const uint width, const uint height,
+              const uint left, const uint right, const uint top, const uint firstRow, const uint lastRow,
+              const PixelFormat format, const UpsamplingMode mode, const ScanlineCallback& callback) {
+    const ComponentPlane* const planes = buffers.planes;
+    std::vector<byte, AlignedAllocator<byte>>& pixels = buffers.pixels;
+    std::vector<byte, AlignedAllocator<byte>>* const upsampled = buffers.upsampled;
+    const uint outputWidth = right - left;
+    pixels.resize((std::size_t)outputWidth * pixelSize(format));
+    for (uint j = 0; j < header->numComponents; ++j) {
+        upsampled[j].resize(outputWidth + 8);
+    }
+    for (uint y = firstRow; y < lastRow; ++y) {
+        const byte* row = pixels.data();
+        {
+            JPG_TIME(colorSeconds);
+            //luma alone is the grayscale image and is handed over without a copy
+            if (format == PixelFormat::Gray) {
+                row = header->numComponents == 3 ? componentRow(planes, 0, width, height, y, left, right, upsampled[0].data(), mode)
+                                                 : planes[0].row(y) + left;
+            }
+            else if (header->numComponents == 3) {
+                const byte* const yRow = componentRow(planes, 0, width, height, y, left, right, upsampled[0].data(), mode);
+                const byte* const cbRow = componentRow(planes, 1, width, height, y, left, right, upsampled[1].data(), mode);
+                const byte* const crRow = componentRow(planes, 2, width, height, y, left, right, upsampled[2].data(), mode);
+                kernels.YCbCrToPixels(yRow, cbRow, crRow, pixels.data(), outputWidth, format);
+            }
+            else {
+                kernels.grayToPixels(planes[0].row(y) + left, pixels.data(), outputWidth, format);
+            }
+        }
+        JPG_TIME(outputSeconds);
+        if (!callback(y - top, row)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//size of the decoded image at 1/scale, partial pixels round up
+void scaledSize(const Header* const header, const uint scale, uint& width, uint& height) {
+    width = (header->width + scale - 1) / scale;
+    height = (header->height + scale - 1) / scale;
+}
+
+//the window of the scaled image that is decoded, [left, right) x [top, bottom)
+//the crop window is clipped to the image, which leaves it empty when they don't overlap
+void outputWindow(const Header* const header, const DecodeOptions& options, uint& left, uint& top, uint& right, uint& bottom) {
+    uint width = 0;
+    uint height = 0;
+    scaledSize(header, options.scale, width, height);
+    left = 0;
+    top = 0;
+    right = width;
+    bottom = height;
+    if (options.cropWidth == 0 || options.cropHeight == 0) {
+        return;
+    }
+    left = options.cropX < width ? options.cropX : width;
+    top = options.cropY < height ? options.cropY : height;
+    right = options.cropWidth < width - left ? left + options.cropWidth : width;
+    bottom = options.cropHeight < height - top ? top + options.cropHeight : height;
+}
+
+//true when options ask for a supported scale and a window with something in it
+bool checkOptions(const Header* const header, const DecodeOptions& options) {
+    if (options.scale != 1 && options.scale != 2 && options.scale != 4 && options.scale != 8) {
+        JPG_LOG(LogLevel::Error, "Error - scale has to be 1, 2, 4 or 8");
+        return false;
+    }
+    uint left = 0;
+    uint top = 0;
+    uint right = 0;
+    uint bottom = 0;
+    outputWindow(header, options, left, top, right, bottom);
+    if (left >= right || top >= bottom) {
+        JPG_LOG(LogLevel::Error, "Error - crop window outside of the image");
+        return false;
+    }
+    return true;
+}
+
+
+//size the planes of every component for decoding at 1/scale, true when any of them needs upsampling
+//like the IJG library, subsampled components are brought up to size by a larger inverse DCT
+//where the sampling ratios allow it, so they need less or no upsampling. the planes hold mcuRows MCU rows
+bool setupPlanes(const Header* const header, const uint scale, ComponentPlane* const planes, const uint mcuRows = 3) {
+    const uint minBlockSize = 8 / scale;
+    bool upsampled = false;
+    for (uint j = 0; j < header->numComponents; ++j) {
+        const ColorComponent& component = header->colorComponents[j];
+        uint blockSize = minBlockSize;
+        while (blockSize < 8 &&
+               (header->maxHorizontalSamplingFactor * minBlockSize) % (component.horizontalSamplingFactor * blockSize * 2) == 0 &&
+               (header->maxVerticalSamplingFactor * minBlockSize) % (component.verticalSamplingFactor * blockSize * 2) == 0) {
+            blockSize *= 2;
+        }
+        planes[j].blockSize = blockSize;
+        planes[j].horizontalRatio = (header->maxHorizontalSamplingFactor * minBlockSize) / (component.horizontalSamplingFactor * blockSize);
+        planes[j].verticalRatio = (header->maxVerticalSamplingFactor * minBlockSize) / (component.verticalSamplingFactor * blockSize);
+        planes[j].stride = (header->mcuWidth * component.horizontalSamplingFactor * blockSize + 31) & ~31u;
+        planes[j].rows = mcuRows * blockSize * component.verticalSamplingFactor;
+        planes[j].samples.resize((std::size_t)planes[j].stride * planes[j].rows);
+        upsampled = upsampled || planes[j].horizontalRatio > 1 || planes[j].verticalRatio > 1;
+    }
+    return upsampled;
+}
+
+
+//bounded queue of MCU rows from one producer to any number of consumers
+//every slot has a sequence number, row when it's free to take row and row + 1 once row is in it.
+//a consumer claims the oldest row with a compare-and-swap and gives its slot back with release,
+//which makes it free for row + PIPELINE_DEPTH. cancel wakes everybody up for good.
+//rows move without locks, only a thread that has to wait for the other side sleeps on changed,
+//and the other side only takes the lock to wake it when somebody is waiting
+class MCURowRing {
+    private:
+        std::atomic<uint> sequences[PIPELINE_DEPTH];
+        std::atomic<uint> tail;
+        //one past the last row that will ever be published
+        std::atomic<uint> end;
+        std::atomic<bool> cancelled;
+        std::atomic<uint> waiting;
+        std::mutex lock;
+        std::condition_variable changed;
+
+        //every change is stored before waiting is read, and waiting is counted before a waiter looks
+        //at the state, so either the waiter sees the change or the change sees the waiter
+        void notify() {
+            if (waiting > 0) {
+                { std::lock_guard<std::mutex> guard(lock); }
+                changed.notify_all();
+            }
+        }
+        void wait(const std::function<bool()>& ready) {
+            std::unique_lock<std::mutex> guard(lock);
+            ++waiting;
+            changed.wait(guard, ready);
+            --waiting;
+        }
+    public:
+        MCURowRing(const uint firstRow) : tail(firstRow), end(UINT_MAX), cancelled(false), waiting(0) {
+            for (uint row = firstRow; row < firstRow + PIPELINE_DEPTH; ++row) {
+                sequences[row % PIPELINE_DEPTH] = row;
+            }
+        }
+
+        //producer, wait until the slot of row is free, false when cancelled
+        bool acquire(const uint row) {
+            std::atomic<uint>& sequence = sequences[row % PIPELINE_DEPTH];
+            if (sequence != row && !cancelled) {
+                wait([&]() { return sequence == row || cancelled; });
+            }
+            return !cancelled;
+        }
+        void publish(const uint row) {
+            sequences[row % PIPELINE_DEPTH] = row + 1;
+            notify();
+        }
+        //producer, no rows from end on
+        void finish(const uint endRow) {
+            end = endRow;
+            notify();
+        }
+
+        //consumers, claim the next published row, false once there are none left or when cancelled
+        bool pop(uint& row) {
+            uint position = tail;
+            while (position < end && !cancelled) {
+                if (sequences[position % PIPELINE_DEPTH] != position + 1) {
+                    wait([&]() {
+                        return tail != position || sequences[position % PIPELINE_DEPTH] == position + 1 || position >= end || cancelled;
+                    });
+                    position = tail;
+                }
+                else if (tail.compare_exchange_weak(position, position + 1)) {
+                    row = position;
+                    return true;
+                }
+            }
+            return false;
+        }
+        void release(const uint row) {
+            sequences[row % PIPELINE_DEPTH] = row + PIPELINE_DEPTH;
+            notify();
+        }
+
+        void cancel() {
+            cancelled = true;
+            notify();
+        }
+};
+
+
+//entropy decode the MCU rows [firstMCURow, lastMCURow) on this thread, handing each one over to numWorkers
+//threads through a ring of buffers.pipeline. the workers run the inverse DCT of the rows, whichever finishes a row
+//that lets the next row be emitted calls emitMCURow on it, one at a time and in order. row r can be emitted once
+//rows r and r + 1 are transformed and its buffer is only given back after that, so the planes need to hold
+//PIPELINE_DEPTH + 2 MCU rows: the one above the oldest row in flight, and the rows in flight
+bool decodePipelined(Header* const header, DecodeBuffers& buffers, const uint firstMCURow, const uint lastMCURow,
+                     const uint firstMCUColumn, const uint lastMCUColumn, uint numWorkers, const std::function<bool(uint)>& emitMCURow) {
+    for (uint slot = 0; slot < PIPELINE_DEPTH; ++slot) {
+        for (uint j = 0; j < header->numComponents; ++j) {
+            ComponentCoefficients& coefficients = buffers.pipeline[slot][j];
+            coefficients.blocksWide = header->mcuWidth * header->colorComponents[j].horizontalSamplingFactor;
+            coefficients.blocksHigh = header->colorComponents[j].verticalSamplingFactor;
+            coefficients.blocks.resize((std::size_t)coefficients.blocksWide * coefficients.blocksHigh);
+            coefficients.lastIndices.resize((std::size_t)coefficients.blocksWide * coefficients.blocksHigh);
+        }
+    }
+    if (numWorkers == 0) {
+        const uint hardwareThreads = std::thread::hardware_concurrency();
+        numWorkers = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+
+    MCURowRing ring(firstMCURow);
+    //row + 1 of the last row transformed in each slot
+    std::atomic<uint> transformed[PIPELINE_DEPTH];
+    for (std::atomic<uint>& row : transformed) {
+        row = 0;
+    }
+    std::atomic<uint> nextEmit(firstMCURow);
+    std::atomic<bool> failed(false);
+    std::mutex emitLock;
+    auto isTransformed = [&transformed](const uint row) {
+        return transformed[row % PIPELINE_DEPTH].load(std::memory_order_acquire) == row + 1;
+    };
+    auto canEmit = [&](const uint row) {
+        return row < lastMCURow && isTransformed(row) && (row + 1 == lastMCURow || isTransformed(row + 1));
+    };
+    //a worker that finds another one emitting leaves it to that one, which looks again after letting go
+    auto emitReady = [&]() {
+        while (!failed && canEmit(nextEmit)) {
+            std::unique_lock<std::mutex> lock(emitLock, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                return;
+            }
+            for (uint row = nextEmit; canEmit(row) && !failed; row = ++nextEmit) {
+                if (!emitMCURow(row)) {
+                    failed = true;
+                    ring.cancel();
+                }
+                ring.release(row);
+            }
+        }
+    };
+
+    WorkerPool& workers = workerPool(buffers);
+#if defined(JPG_STATS)
+    std::mutex statsLock;
+    DecodeStats workerStats;
+#endif
+    workers.start(numWorkers, [&](uint) {
+        uint row = 0;
+        while (ring.pop(row)) {
+            {
+                JPG_TIME(idctSeconds);
+                inverseDCTRow(header, buffers.pipeline[row % PIPELINE_DEPTH], row, firstMCUColumn, lastMCUColumn, buffers.planes);
+            }
+            transformed[row % PIPELINE_DEPTH].store(row + 1, std::memory_order_release);
+            emitReady();
+        }
+#if defined(JPG_STATS)
+        std::lock_guard<std::mutex> guard(statsLock);
+        addStats(workerStats, threadStats);
+        threadStats = DecodeStats();
+#endif
+    });
+
+    //the decoded row trades its blocks for the ones of the free slot, so nothing is copied
+    uint produced = firstMCURow;
+    const bool decoded = decodeMCURows(header, buffers.coefficients, firstMCURow, lastMCURow, firstMCUColumn, lastMCUColumn,
+                                       [&](const uint mcuRow) {
+        if (!ring.acquire(mcuRow)) {
+            return false;
+        }
+        ComponentCoefficients* const slot = buffers.pipeline[mcuRow % PIPELINE_DEPTH];
+        for (uint j = 0; j < header->numComponents; ++j) {
+            slot[j].blocks.swap(buffers.coefficients[j].blocks);
+            slot[j].lastIndices.swap(buffers.coefficients[j].lastIndices);
+            slot[j].firstRow = buffers.coefficients[j].firstRow;
+        }
+        ring.publish(mcuRow);
+        produced = mcuRow + 1;
+        return true;
+    });
+    ring.finish(produced);
+    if (!decoded) {
+        failed = true;
+        ring.cancel();
+    }
+    workers.wait();
+#if defined(JPG_STATS)
+    addStats(threadStats, workerStats);
+#endif
+    return !failed && nextEmit == lastMCURow;
+}
+
+
+//decode the image and pass each row of pixels to callback, top to bottom
+//the planes only hold three MCU rows, so the rows of an MCU row are converted once the next one is
+//decoded and vertical upsampling can see the rows on both sides
+bool decodeImage(Header* const header, const DecodeOptions& options, const PixelFormat format, const ScanlineCallback& callback,
+                 DecodeBuffers& buffers) {
+    if (!checkOptions(header, options)) {
+        return false;
+    }
+    const uint scale = options.scale;
+    uint width = 0;
+    uint height = 0;
+    scaledSize(header, scale, width, height);
+    uint left = 0;
+    uint top = 0;
+    uint right = 0;
+    uint bottom = 0;
+    outputWindow(header, options, left, top, right, bottom);
+    const uint minBlockSize = 8 / scale;
+    const uint mcuPixelWidth = minBlockSize * header->maxHorizontalSamplingFactor;
+    const uint mcuPixelHeight = minBlockSize * header->maxVerticalSamplingFactor;
+    ComponentPlane* const planes = buffers.planes;
+    const bool pipelined = options.pipelined && canDecodeMCURows(header);
+    const bool upsampled = setupPlanes(header, scale, planes, pipelined ? PIPELINE_DEPTH + 2 : 3);
+    //there is nothing to interpolate between at 1/8, the IJG library doesn't either
+    const UpsamplingMode upsampling = scale == 8 ? UpsamplingMode::Replicate : options.upsampling;
+
+    //the MCUs under the window, upsampling also needs one more MCU on each side
+    const uint context = upsampled ? 1 : 0;
+    const uint firstMCUColumn = left / mcuPixelWidth > context ? left / mcuPixelWidth - context : 0;
+    const uint firstMCURow = top / mcuPixelHeight > context ? top / mcuPixelHeight - context : 0;
+    const uint lastMCUColumn = (right - 1) / mcuPixelWidth + 1 + context < header->mcuWidth ? (right - 1) / mcuPixelWidth + 1 + context : header->mcuWidth;
+    const uint lastMCURow = (bottom - 1) / mcuPixelHeight + 1 + context < header->mcuHeight ? (bottom - 1) / mcuPixelHeight + 1 + context : header->mcuHeight;
+
+    //rows of the window inside MCU row mcuRow
+    auto emitMCURow = [&](const uint mcuRow) {
+        const uint firstRow = mcuRow * mcuPixelHeight > top ? mcuRow * mcuPixelHeight : top;
+        const uint lastRow = (mcuRow + 1) * mcuPixelHeight < bottom ? (mcuRow + 1) * mcuPixelHeight : bottom;
+        return firstRow >= lastRow || emitRows(header, buffers, width, height, left, right, top, firstRow, lastRow, format, upsampling, callback);
+    };
 
+    ComponentCoefficients* const coefficients = buffers.coefficients;
+    auto rowDecoded = [&](const uint mcuRow) {
+        {
+            JPG_TIME(idctSeconds);
+            inverseDCTRow(header, coefficients, mcuRow, firstMCUColumn, lastMCUColumn, planes);
+        }
+        return mcuRow == firstMCURow || emitMCURow(mcuRow - 1);
+    };
 
-//fill coefficients of an MCU component based on Huffman Codes
-//read from bit-reader
-bool decodeMCUComponent(BitReader &b, int* const component, const HuffmanTable& dcTable, const HuffmanTable& acTable) {
-    //get DC values for this mcu component
-    byte length = getNextSymbol(b, dcTable);
+    //images with more than one scan need all of their coefficients before any row is final
+    //a crop is always decoded row by row when possible, since that skips most of the data outside it
+    const bool cropped = left != 0 || top != 0 || right != width || bottom != height;
+    if (pipelined) {
+        return decodePipelined(header, buffers, firstMCURow, lastMCURow, firstMCUColumn, lastMCUColumn, options.numThreads, emitMCURow);
+    }
+    if ((options.streaming || cropped) && canDecodeMCURows(header)) {
+        if (!decodeMCURows(header, coefficients, firstMCURow, lastMCURow, firstMCUColumn, lastMCUColumn, rowDecoded)) {
+            return false;
+        }
+    }
+    else {
+        if (!decodeHuffmanData(header, coefficients, workerPool(buffers), options.numThreads, firstMCURow, lastMCURow)) {
+            return false;
+        }
+        for (uint mcuRow = firstMCURow; mcuRow < lastMCURow; ++mcuRow) {
+            if (!rowDecoded(mcuRow)) {
+                return false;
+            }
+        }
+    }
+    return emitMCURow(lastMCURow - 1);
+}
+
+//decode with working memory that only lives for this image
+bool decodeImage(Header* const header, const DecodeOptions& options, const PixelFormat format, const ScanlineCallback& callback) {
+    DecodeBuffers buffers;
+    return decodeImage(header, options, format, callback, buffers);
 }
 
 
-MCU* decodeHuffmanData(Header* const header){
-    const uint mcuHeight = (header->height + 7)/8;
-    const uint mcuWidth = (header->width +7)/8;
-    MCU* mcus = new (std::nothrow) MCU[mcuHeight * mcuWidth];
-    if(mcus == nullptr) {
-        std::cout << "Error - memory error\n";
-        return nullptr;
+//decode the window of the image chosen by options into sink
+bool decodeToSink(Header* const header, const DecodeOptions& options, OutputSink& sink, DecodeBuffers& buffers) {
+    //a decode that can't work doesn't get to create or truncate the output
+    if (!checkOptions(header, options)) {
+        return false;
+    }
+    uint left = 0;
+    uint top = 0;
+    uint right = 0;
+    uint bottom = 0;
+    outputWindow(header, options, left, top, right, bottom);
+    const PixelFormat format = sink.format(header->numComponents);
+    if (!sink.begin(right - left, bottom - top, format)) {
+        return false;
+    }
+    const bool success = decodeImage(header, options, format, [&sink](const uint y, const byte* const pixels) {
+        return sink.writeRow(y, pixels);
+    }, buffers);
+    return success && sink.finish();
+}
+
+bool decodeToSink(Header* const header, const DecodeOptions& options, OutputSink& sink) {
+    DecodeBuffers buffers;
+    return decodeToSink(header, options, sink, buffers);
+}
+
+
+//stop after the entropy decoding, image describes the quantized coefficients left in coefficients
+//nothing is dequantized, transformed or converted, which is all re-compression or DCT-domain analysis needs
+bool decodeCoefficients(Header* const header, ComponentCoefficients* const coefficients, WorkerPool& workers, ImageCoefficients& image,
+                        const uint numThreads = 0) {
+    image = ImageCoefficients();
+    if (!decodeHuffmanData(header, coefficients, workers, numThreads)) {
+        return false;
+    }
+    image.frameType = header->frameType;
+    image.width = header->width;
+    image.height = header->height;
+    image.numComponents = header->numComponents;
+    image.maxHorizontalSamplingFactor = header->maxHorizontalSamplingFactor;
+    image.maxVerticalSamplingFactor = header->maxVerticalSamplingFactor;
+    image.mcuWidth = header->mcuWidth;
+    image.mcuHeight = header->mcuHeight;
+    for (uint j = 0; j < header->numComponents; ++j) {
+        const ColorComponent& component = header->colorComponents[j];
+        CoefficientPlane& plane = image.components[j];
+        plane.blocks = coefficients[j].blocks.data();
+        plane.blocksWide = coefficients[j].blocksWide;
+        plane.blocksHigh = coefficients[j].blocksHigh;
+        //the component's own samples, rounded up, in blocks
+        const uint componentWidth = ((uint64_t)header->width * component.horizontalSamplingFactor + header->maxHorizontalSamplingFactor - 1) / header->maxHorizontalSamplingFactor;
+        const uint componentHeight = ((uint64_t)header->height * component.verticalSamplingFactor + header->maxVerticalSamplingFactor - 1) / header->maxVerticalSamplingFactor;
+        plane.widthInBlocks = (componentWidth + 7) / 8;
+        plane.heightInBlocks = (componentHeight + 7) / 8;
+        plane.horizontalSamplingFactor = component.horizontalSamplingFactor;
+        plane.verticalSamplingFactor = component.verticalSamplingFactor;
+        plane.quantizationTable = header->quantizationTables[component.quantizationTableID];
     }
+    return true;
+}
 
-    for(uint i = 0; i < 4; ++i) {
-        if(header->dcHuffmanTables[i].set) {
-            getCodes(header->dcHuffmanTables[i]);
+
+//helper functions to write 4-byte int and 2-byte short in little endian
+void writeInt (std::vector<byte>& out, const uint s) {
+    out.push_back((s >> 0) & 0xFF);
+    out.push_back((s >> 8) & 0xFF);
+    out.push_back((s >> 16) & 0xFF);
+    out.push_back((s >> 24) & 0xFF);
+}
+
+void writeShort (std::vector<byte>& out, const uint s) {
+    out.push_back((s >> 0) & 0xFF);
+    out.push_back((s >> 8) & 0xFF);
+}
+
+
+//Bitmap file, 24-bit or 8-bit gray. the file is sized up front and mapped, rows arrive top to bottom
+//and are copied straight to their place counting from the bottom, the row padding is left as the zeros
+//of the new file. finished rows are released every so often, so memory doesn't grow with the image
+class BMPSink : public OutputSink {
+    private:
+        const std::string filename;
+        MappedOutputFile outFile;
+        std::size_t pixelBytes = 0;
+        std::size_t rowSize = 0;
+        std::size_t dataOffset = 0;
+        //rows from here to the end of the file are final and released
+        std::size_t releasedOffset = 0;
+        uint height = 0;
+        //size of the file header and the core info header
+        static const uint headerSize = 14 + 12;
+        //bytes written between releases
+        static const std::size_t releaseSize = 1 << 20;
+    public:
+        BMPSink(const std::string& outFilename) : filename(outFilename) {}
+
+        //grayscale images are written as 8-bit pixels with a gray palette, a third of the size of 24-bit
+        PixelFormat format(const byte numComponents) const override {
+            return numComponents == 1 ? PixelFormat::Gray : PixelFormat::BGR;
         }
-        if(header->acHuffmanTables[i].set) {
-            getCodes(header->acHuffmanTables[i]);
+
+        bool begin(const uint width, const uint imageHeight, const PixelFormat pixelFormat) override {
+            height = imageHeight;
+            const bool gray = pixelFormat == PixelFormat::Gray;
+            pixelBytes = (std::size_t)width * (gray ? 1 : 3);
+            //rows are padded to a multiple of 4 bytes
+            rowSize = (pixelBytes + 3) & ~(std::size_t)3;
+            //JPEG dimensions are 16 bits, so they always fit the core info header. its palette entries are 3 bytes
+            dataOffset = headerSize + (gray ? 256 * 3 : 0);
+            const std::size_t totalSize = dataOffset + height * rowSize;
+
+            //the file size field can't hold more than 4GB, readers go by the dimensions
+            std::vector<byte> header;
+            header.push_back('B');
+            header.push_back('M');
+            writeInt(header, totalSize <= 0xFFFFFFFF ? totalSize : 0);
+            writeInt(header, 0);
+            writeInt(header, dataOffset);
+            writeInt(header, 12);
+            writeShort(header, width);
+            writeShort(header, height);
+            writeShort(header, 1);
+            writeShort(header, gray ? 8 : 24);
+            for (uint i = 0; gray && i < 256; ++i) {
+                header.push_back(i);
+                header.push_back(i);
+                header.push_back(i);
+            }
+
+            if (!outFile.create(filename, totalSize)) {
+                JPG_LOG(LogLevel::Error, "Error opening output file");
+                return false;
+            }
+            outFile.write(0, header.data(), header.size());
+            releasedOffset = totalSize;
+            return true;
         }
-    }
-    BitReader reader(header->huffmanData);
 
-    for(uint i=0; i< mcuHeight*mcuWidth; ++i) {
-        for(uint j=0; j < header->numComponents; ++j) {
-            if(!decodeMCUComponent(reader, 
-                                    mcus[i][j], 
-                                    header->dcHuffmanTables[header->colorComponents[j].dcHuffmanTableID], 
-                                    header->acHuffmanTables[header->colorComponents[j].acHuffmanTableID])) {
-                delete[] mcus;
+        bool writeRow(const uint y, const byte* const pixels) override {
+            const std::size_t offset = dataOffset + (std::size_t)(height - 1 - y) * rowSize;
+            outFile.write(offset, pixels, pixelBytes);
+            if (releasedOffset - offset >= releaseSize) {
+                outFile.release(offset, releasedOffset);
+                releasedOffset = offset;
+            }
+            return outFile.good();
+        }
+
+        bool finish() override {
+            return outFile.close();
+        }
+};
+
+
+//binary PGM (P5) for grayscale images and PPM (P6) for color ones, rows are stored top to bottom
+class PNMSink : public OutputSink {
+    private:
+        const std::string filename;
+        std::ofstream outFile;
+        std::size_t rowSize = 0;
+        //a file begin created is removed again unless finish gets to close it cleanly
+        bool created = false;
+        bool finished = false;
+    public:
+        PNMSink(const std::string& outFilename) : filename(outFilename) {}
+
+        PixelFormat format(const byte numComponents) const override {
+            return numComponents == 1 ? PixelFormat::Gray : PixelFormat::RGB;
+        }
+
+        bool begin(const uint width, const uint height, const PixelFormat pixelFormat) override {
+            outFile.open(filename, std::ios::out | std::ios::binary);
+            if(!outFile.is_open()) {
+                JPG_LOG(LogLevel::Error, "Error opening output file");
+                return false;
+            }
+            created = true;
+            outFile << (pixelFormat == PixelFormat::Gray ? "P5" : "P6") << "\n" << width << " " << height << "\n255\n";
+            rowSize = (std::size_t)width * pixelSize(pixelFormat);
+            return outFile.good();
+        }
+
+        bool writeRow(const uint, const byte* const pixels) override {
+            outFile.write((const char*)pixels, rowSize);
+            return outFile.good();
+        }
+
+        bool finish() override {
+            outFile.close();
+            finished = !outFile.fail();
+            return finished;
+        }
+
+        ~PNMSink() {
+            if (outFile.is_open()) {
+                outFile.close();
+            }
+            if (created && !finished) {
+                std::error_code error;
+                std::filesystem::remove(filename, error);
+            }
+        }
+};
+
+
+//the whole image as one interleaved buffer in memory, rows top to bottom without padding
+class RawSink : public OutputSink {
+    private:
+        const PixelFormat colorFormat;
+        std::vector<byte> buffer;
+        std::size_t rowSize = 0;
+        uint imageWidth = 0;
+        uint imageHeight = 0;
+    public:
+        //grayscale images come out as Gray, color ones as colorFormat
+        RawSink(const PixelFormat pixelFormat = PixelFormat::RGB) : colorFormat(pixelFormat) {}
+
+        PixelFormat format(const byte numComponents) const override {
+            return numComponents == 1 ? PixelFormat::Gray : colorFormat;
+        }
+
+        bool begin(const uint width, const uint height, const PixelFormat pixelFormat) override {
+            imageWidth = width;
+            imageHeight = height;
+            rowSize = (std::size_t)width * pixelSize(pixelFormat);
+            buffer.resize(rowSize * height);
+            return true;
+        }
+
+        bool writeRow(const uint y, const byte* const pixels) override {
+            std::memcpy(buffer.data() + y * rowSize, pixels, rowSize);
+            return true;
+        }
+
+        bool finish() override {
+            return true;
+        }
+
+        const std::vector<byte>& pixels() const {
+            return buffer;
+        }
+        uint width() const {
+            return imageWidth;
+        }
+        uint height() const {
+            return imageHeight;
+        }
+};
+
+//interleaved pixels without a header written in place into a mapped file, like RawSink without the memory
+class RawFileSink : public OutputSink {
+    private:
+        const std::string filename;
+        MappedOutputFile outFile;
+        std::size_t rowSize = 0;
+        //rows before this offset are final and released
+        std::size_t releasedOffset = 0;
+        static const std::size_t releaseSize = 1 << 20;
+    public:
+        RawFileSink(const std::string& outFilename) : filename(outFilename) {}
+
+        PixelFormat format(const byte numComponents) const override {
+            return numComponents == 1 ? PixelFormat::Gray : PixelFormat::RGB;
+        }
+
+        bool begin(const uint width, const uint height, const PixelFormat pixelFormat) override {
+            rowSize = (std::size_t)width * pixelSize(pixelFormat);
+            releasedOffset = 0;
+            if (!outFile.create(filename, rowSize * height)) {
+                JPG_LOG(LogLevel::Error, "Error opening output file");
+                return false;
+            }
+            return true;
+        }
+
+        bool writeRow(const uint y, const byte* const pixels) override {
+            const std::size_t offset = (std::size_t)y * rowSize;
+            outFile.write(offset, pixels, rowSize);
+            if (offset + rowSize - releasedOffset >= releaseSize) {
+                outFile.release(releasedOffset, offset + rowSize);
+                releasedOffset = offset + rowSize;
+            }
+            return outFile.good();
+        }
+
+        bool finish() override {
+            return outFile.close();
+        }
+};
+
+
+//decode into a Bitmap image
+bool writeBMP(Header* const header, const std::string& outFilename, const DecodeOptions& options) {
+    BMPSink sink(outFilename);
+    return decodeToSink(header, options, sink);
+}
+
+
+//decodes one image after another and keeps its memory from one to the next: the header,
+//the contents of the file, the coefficients and the row buffers only grow when an image
+//needs more than the ones before it. a decoder is used by one thread at a time
+class Decoder {
+    private:
+        Header header;
+        std::vector<byte> fileData;
+        DecodeBuffers buffers;
+        DecodeStats decodeStats;
+    public:
+        Decoder() {}
+        Decoder(const Decoder&) = delete;
+        Decoder& operator=(const Decoder&) = delete;
+
+        //parse a JPEG held in memory, the buffer has to outlive the decode
+        //the header belongs to the decoder and is only good until the next read
+        Header* read(const byte* const data, const std::size_t size) {
+            startStats();
+            readJPG(data, size, &header);
+            decodeStats = currentStats();
+            return &header;
+        }
+
+        //read a whole file into the decoder's own buffer and parse it
+        Header* read(const std::string& filename) {
+            //the header of the last read points into fileData, it's no good once that is replaced or fails
+            header.valid = false;
+            std::ifstream inFile(filename, std::ios::in | std::ios::binary | std::ios::ate);
+            if (!inFile.is_open()) {
+                JPG_LOG(LogLevel::Error, "Error opening file!");
                 return nullptr;
             }
+            const std::streamoff size = inFile.tellg();
+            if (size < 0) {
+                JPG_LOG(LogLevel::Error, "Error opening file!");
+                return nullptr;
+            }
+            fileData.resize((std::size_t)size);
+            inFile.seekg(0);
+            inFile.read((char*)fileData.data(), fileData.size());
+            if (!inFile) {
+                JPG_LOG(LogLevel::Error, "Error reading file!");
+                return nullptr;
+            }
+            return read(fileData.data(), fileData.size());
+        }
+
+        //decode the image of the last read
+        bool decode(const DecodeOptions& options, const PixelFormat format, const ScanlineCallback& callback) {
+            startStats(decodeStats);
+            const bool success = header.valid && decodeImage(&header, options, format, callback, buffers);
+            decodeStats = currentStats();
+            return success;
+        }
+        bool decode(const DecodeOptions& options, OutputSink& sink) {
+            startStats(decodeStats);
+            const bool success = header.valid && decodeToSink(&header, options, sink, buffers);
+            decodeStats = currentStats();
+            return success;
+        }
+
+        //only the quantized coefficients of the image of the last read, good until the next decode
+        bool decodeCoefficients(ImageCoefficients& image, const uint numThreads = 0) {
+            startStats(decodeStats);
+            const bool success = header.valid && ::decodeCoefficients(&header, buffers.coefficients, workerPool(buffers), image, numThreads);
+            decodeStats = currentStats();
+            return success;
+        }
+
+        //counters and timings of the last read and decode, all zero unless built with -DJPG_STATS
+        const DecodeStats& stats() const {
+            return decodeStats;
+        }
+};
+
+
+//log the stats of a decode, nothing unless built with -DJPG_STATS
+void printStats(const DecodeStats& stats) {
+#if defined(JPG_STATS)
+    JPG_LOG(LogLevel::Info, "Bits consumed = " << stats.bitsConsumed << ", bytes unstuffed = " << stats.bytesUnstuffed
+            << ", huffman slow path = " << stats.huffmanSlowPath << ", restart intervals = " << stats.restartIntervals);
+    JPG_LOG(LogLevel::Info, "Blocks = " << stats.blocks << ", DC only = " << stats.dcOnlyBlocks << ", sparse = " << stats.sparseBlocks);
+    JPG_LOG(LogLevel::Info, "Seconds: parse = " << stats.parseSeconds << ", entropy = " << stats.entropySeconds << ", idct = " << stats.idctSeconds
+            << ", color = " << stats.colorSeconds << ", output = " << stats.outputSeconds);
+#else
+    (void)stats;
+#endif
+}
+
+
+//file formats the command line can write
+enum class OutputFormat {
+    BMP,
+    PNM,
+    Raw
+};
+
+//decode one file into an image of the given format next to it, pixels receives the size of the output
+//verbose prints the header of the file first
+bool convertFile(Decoder& decoder, const std::string& filename, const DecodeOptions& options, const OutputFormat outputFormat,
+                 const bool verbose, uint64_t& pixels) {
+    Header* header = decoder.read(filename);
+    if (header == nullptr || header->valid == false) {
+        return false;
+    }
+    if (verbose) {
+        printHeader(header);
+    }
+
+    const std::size_t pos = filename.find_last_of('.');
+    const std::string baseName = (pos == std::string::npos) ? filename : filename.substr(0 , pos);
+    bool success = false;
+    if (outputFormat == OutputFormat::BMP) {
+        //decode straight into the bmp file, rows are converted as they are written
+        BMPSink sink(baseName + ".bmp");
+        success = decoder.decode(options, sink);
+    }
+    else if (outputFormat == OutputFormat::PNM) {
+        PNMSink sink(baseName + (header->numComponents == 1 ? ".pgm" : ".ppm"));
+        success = decoder.decode(options, sink);
+    }
+    else {
+        RawFileSink sink(baseName + ".raw");
+        success = decoder.decode(options, sink);
+    }
+    uint left = 0;
+    uint top = 0;
+    uint right = 0;
+    uint bottom = 0;
+    outputWindow(header, options, left, top, right, bottom);
+    pixels = success ? (uint64_t)(right - left) * (bottom - top) : 0;
+    if (verbose) {
+        printStats(decoder.stats());
+    }
+    return success;
+}
+
+
+//run jobs [0, numJobs) on numThreads workers, job(worker, index) is called once for every job
+//each worker starts with an even share of the jobs and takes them from the front of its share,
+//a worker that runs out steals from the back of the others. a share is a [begin, end) range packed
+//into one atomic so taking from either end is a single compare-and-swap
+void runWorkStealing(const uint numJobs, const uint numThreads, const std::function<void(uint, uint)>& job) {
+    struct alignas(64) Share {
+        std::atomic<uint64_t> range;
+    };
+    std::vector<Share> shares(numThreads);
+    for (uint t = 0; t < numThreads; ++t) {
+        const uint64_t begin = (uint64_t)numJobs * t / numThreads;
+        const uint64_t end = (uint64_t)numJobs * (t + 1) / numThreads;
+        shares[t].range = (begin << 32) | end;
+    }
+
+    auto take = [](Share& share, const bool front, uint& index) {
+        uint64_t range = share.range.load();
+        while (true) {
+            const uint begin = range >> 32;
+            const uint end = (uint)range;
+            if (begin >= end) {
+                return false;
+            }
+            const uint64_t next = front ? (((uint64_t)(begin + 1) << 32) | end) : (((uint64_t)begin << 32) | (end - 1));
+            if (share.range.compare_exchange_weak(range, next)) {
+                index = front ? begin : end - 1;
+                return true;
+            }
         }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint t = 0; t < numThreads; ++t) {
+        workers.emplace_back([&, t]() {
+            uint index = 0;
+            while (true) {
+                if (take(shares[t], true, index)) {
+                    job(t, index);
+                    continue;
+                }
+                bool stolen = false;
+                for (uint k = 1; k < numThreads && !stolen; ++k) {
+                    stolen = take(shares[(t + k) % numThreads], false, index);
+                }
+                if (!stolen) {
+                    return;
+                }
+                job(t, index);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+
+//a file to decode and the options given before it on the command line
+struct Job {
+    std::string filename;
+    DecodeOptions options;
+    OutputFormat outputFormat;
+};
+
+//decode every job on numThreads workers and print a summary of the throughput and the failures
+//the decoder's own messages are dropped while the workers run, quiet also drops the line per file
+int runBatch(const std::vector<Job>& jobs, uint numThreads, const bool quiet) {
+    if (numThreads == 0) {
+        numThreads = std::thread::hardware_concurrency();
+    }
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    if (numThreads > jobs.size()) {
+        numThreads = jobs.size() > 0 ? jobs.size() : 1;
     }
 
-    return mcus;
+    //what each worker did, merged once they are done
+    struct WorkerState {
+        //reused for every file the worker decodes
+        Decoder decoder;
+        uint decoded = 0;
+        uint64_t pixels = 0;
+        std::vector<std::string> failures;
+    };
+    std::vector<WorkerState> states(numThreads);
+    std::mutex reportLock;
+    const LogLevel level = logLevel;
+    setLogging(LogLevel::None);
+
+    const auto start = std::chrono::steady_clock::now();
+    runWorkStealing(jobs.size(), numThreads, [&](const uint worker, const uint index) {
+        //files are the unit of parallelism, so each one is decoded on a single thread
+        DecodeOptions options = jobs[index].options;
+        options.numThreads = 1;
+        uint64_t pixels = 0;
+        WorkerState& state = states[worker];
+        //a file that runs out of memory or throws otherwise fails on its own, the others go on
+        bool success = false;
+        try {
+            success = convertFile(state.decoder, jobs[index].filename, options, jobs[index].outputFormat, false, pixels);
+        }
+        catch (const std::exception&) {
+            success = false;
+        }
+        if (success) {
+            state.decoded += 1;
+            state.pixels += pixels;
+        }
+        else {
+            state.failures.push_back(jobs[index].filename);
+        }
+        if (!quiet) {
+            std::lock_guard<std::mutex> guard(reportLock);
+            std::cout << (success ? "ok     " : "FAILED ") << jobs[index].filename << "\n";
+        }
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    setLogging(level);
+
+    uint decoded = 0;
+    uint64_t pixels = 0;
+    std::vector<std::string> failures;
+    for (const WorkerState& state : states) {
+        decoded += state.decoded;
+        pixels += state.pixels;
+        failures.insert(failures.end(), state.failures.begin(), state.failures.end());
+    }
+    std::cout << "Decoded " << decoded << " of " << jobs.size() << " images on " << numThreads << " threads in " << seconds << " s\n";
+    std::cout << "Throughput : " << (seconds > 0 ? decoded / seconds : 0) << " images/s, "
+              << (seconds > 0 ? pixels / 1e6 / seconds : 0) << " MP/s\n";
+    std::cout << "Failed : " << failures.size() << "\n";
+    for (const std::string& failure : failures) {
+        std::cout << "    " << failure << "\n";
+    }
+    return failures.empty() ? 0 : 1;
 }
 
 
-//helper functions to write 4-byte int and 2-byte short in little endian
-void writeInt (std::ofstream& outFile, const uint s) {
-    outFile.put((s >> 0) & 0xFF);
-    outFile.put((s >> 8) & 0xFF);
-    outFile.put((s >> 16) & 0xFF);
-    outFile.put((s >> 24) & 0xFF);
+//the JPEG files in a directory, sorted by name
+void listDirectory(const std::string& directory, const DecodeOptions& options, const OutputFormat outputFormat, std::vector<Job>& jobs) {
+    std::vector<std::string> filenames;
+    std::error_code error;
+    for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, error)) {
+        std::string extension = entry.path().extension().string();
+        for (char& c : extension) {
+            c = std::tolower((unsigned char)c);
+        }
+        if (entry.is_regular_file(error) && (extension == ".jpg" || extension == ".jpeg")) {
+            filenames.push_back(entry.path().string());
+        }
+    }
+    std::sort(filenames.begin(), filenames.end());
+    for (const std::string& filename : filenames) {
+        jobs.push_back({ filename, options, outputFormat });
+    }
 }
 
-void writeShort (std::ofstream& outFile, const uint s) {
-    outFile.put((s >> 0) & 0xFF);
-    outFile.put((s >> 8) & 0xFF);
+
+#if defined(JPG_BENCHMARK)
+
+//corpus benchmark, built in place of the command line with -DJPG_BENCHMARK
+//every file is read into memory once, then each is decoded iterations times one stage after another.
+//stages are timed on their own with the decoder's messages dropped, results are one JSON object per line
+
+const uint numStages = 6;
+const char* const stageNames[numStages] = { "parse", "entropy", "idct", "color", "output", "total" };
+
+//value at fraction of the way through the sorted values
+double percentile(std::vector<double> values, const double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(std::size_t)(fraction * (values.size() - 1) + 0.5)];
 }
 
+//decode data once stage by stage into RGB, seconds receives the time of each stage
+//total is a separate decode through the decoder and a sink, like the command line does it
+bool timeStages(const std::vector<byte>& data, Header& header, DecodeBuffers& buffers, Decoder& decoder, RawSink& sink,
+                const uint numThreads, double* const seconds) {
+    typedef std::chrono::steady_clock Clock;
+    auto elapsed = [](const Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
 
-//output Bitmap image
-void writeBMP(const Header* const header, const MCU* const mcus, const std::string& outFilename) {
-    std::ofstream outFile = std::ofstream(outFilename, std::ios::out | std::ios::binary);
-    if(!outFile.is_open()) {
-        std::cout << "Error opening output file\n";
-        return;
+    Clock::time_point start = Clock::now();
+    readJPG(data.data(), data.size(), &header);
+    seconds[0] = elapsed(start);
+    if (!header.valid) {
+        return false;
     }
 
-    
-    const uint mcuHeight = (header->height + 7)/8;
-    const uint mcuWidth = (header->width + 7)/8;
-    const uint paddingSize = (header->width) % 4;
-    const uint totalSize = 14 + 12 + header->height * header->width * 3 + paddingSize * header->height;
+    start = Clock::now();
+    if (!decodeHuffmanData(&header, buffers.coefficients, workerPool(buffers), numThreads)) {
+        return false;
+    }
+    seconds[1] = elapsed(start);
+
+    //the planes only hold three MCU rows, they are overwritten all the way down like in a real decode
+    start = Clock::now();
+    setupPlanes(&header, 1, buffers.planes);
+    for (uint mcuRow = 0; mcuRow < header.mcuHeight; ++mcuRow) {
+        inverseDCTRow(&header, buffers.coefficients, mcuRow, 0, header.mcuWidth, buffers.planes);
+    }
+    seconds[2] = elapsed(start);
+
+    //the rows emitRows converts go to the sink, the time spent in the sink is the output stage and the rest is color
+    start = Clock::now();
+    if (!sink.begin(header.width, header.height, PixelFormat::RGB)) {
+        return false;
+    }
+    double outputSeconds = elapsed(start);
+    start = Clock::now();
+    const bool converted = emitRows(&header, buffers, header.width, header.height, 0, header.width, 0, 0, header.height,
+                                    PixelFormat::RGB, UpsamplingMode::Fancy, [&](const uint y, const byte* const row) {
+        const Clock::time_point rowStart = Clock::now();
+        const bool written = sink.writeRow(y, row);
+        outputSeconds += elapsed(rowStart);
+        return written;
+    });
+    seconds[3] = elapsed(start) - outputSeconds;
+    start = Clock::now();
+    if (!converted || !sink.finish()) {
+        return false;
+    }
+    seconds[4] = outputSeconds + elapsed(start);
+
+    DecodeOptions options;
+    options.numThreads = numThreads;
+    start = Clock::now();
+    decoder.read(data.data(), data.size());
+    if (!decoder.decode(options, sink)) {
+        return false;
+    }
+    seconds[5] = elapsed(start);
+    return true;
+}
+
+//a string as a JSON string literal
+std::string jsonString(const std::string& value) {
+    std::string quoted = "\"";
+    for (const char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+//one line of results, the median and 99th percentile of every stage in milliseconds and the megapixels per second at the median
+void printResults(std::ostream& out, const std::string& name, const uint64_t pixels, const uint iterations,
+                  const std::vector<double>* const timings) {
+    out << "{\"file\":" << jsonString(name) << ",\"megapixels\":" << pixels / 1e6 << ",\"iterations\":" << iterations;
+    for (uint i = 0; i < numStages; ++i) {
+        const double median = percentile(timings[i], 0.5);
+        out << ",\"" << stageNames[i] << "\":{\"median_ms\":" << median * 1e3
+            << ",\"p99_ms\":" << percentile(timings[i], 0.99) * 1e3
+            << ",\"mp_per_s\":" << (median > 0 ? pixels / 1e6 / median : 0) << "}";
+    }
+    out << "}\n";
+}
+
+int main (int argc, char** argv) {
+    uint iterations = 10;
+    uint numThreads = 1;
+    std::vector<Job> jobs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string argument(argv[i]);
+        //parsed as signed so a negative count is rejected instead of wrapping around
+        if (argument == "--iterations" && i + 1 < argc) {
+            const int count = std::atoi(argv[++i]);
+            if (count <= 0) {
+                std::cout << "Error - iterations has to be positive: " << argv[i] << "\n";
+                return 1;
+            }
+            iterations = count;
+            continue;
+        }
+        //threads of the entropy decode, 1 times a single core
+        if (argument == "--threads" && i + 1 < argc) {
+            numThreads = std::atoi(argv[++i]);
+            continue;
+        }
+        std::error_code error;
+        if (std::filesystem::is_directory(argument, error)) {
+            listDirectory(argument, DecodeOptions(), OutputFormat::BMP, jobs);
+        }
+        else {
+            jobs.push_back({ argument, DecodeOptions(), OutputFormat::BMP });
+        }
+    }
+    if (jobs.empty()) {
+        std::cout << "usage: " << argv[0] << " [--iterations N] [--threads N] files or directories\n";
+        return 1;
+    }
 
-    outFile.put('B');
-    outFile.put('M');
-    writeInt(outFile, totalSize);
-    writeInt(outFile, 0);
-    writeInt(outFile, 0x1A);
-    writeInt(outFile, 12);
-    writeShort(outFile, header->width);
-    writeShort(outFile, header->height);
-    writeShort(outFile, 1);
-    writeShort(outFile, 24);
+    setLogging(LogLevel::None);
+
+    struct Entry {
+        std::string filename;
+        std::vector<byte> data;
+        uint64_t pixels = 0;
+        bool failed = false;
+        std::vector<double> timings[numStages];
+    };
+    std::vector<Entry> entries(jobs.size());
+    for (uint i = 0; i < jobs.size(); ++i) {
+        entries[i].filename = jobs[i].filename;
+        std::ifstream inFile(jobs[i].filename, std::ios::in | std::ios::binary);
+        entries[i].data.assign(std::istreambuf_iterator<char>(inFile), std::istreambuf_iterator<char>());
+        entries[i].failed = !inFile.is_open();
+    }
 
-    for(uint y = header->height - 1; y < header->height; --y) {
-        const uint mcuRow = y / 8;
-        const uint pixelRow = y % 8;
-        for(uint x = 0; x < header->width; ++x) {
-            const uint mcuColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint mcuIndex = mcuRow * mcuWidth + mcuColumn;
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            outFile.put(mcus[mcuIndex].b[pixelIndex]);
-            outFile.put(mcus[mcuIndex].g[pixelIndex]);
-            outFile.put(mcus[mcuIndex].r[pixelIndex]);
+    std::unique_ptr<Header> header = std::make_unique<Header>();
+    DecodeBuffers buffers;
+    Decoder decoder;
+    RawSink sink;
+    std::vector<double> corpus[numStages];
+    uint64_t corpusPixels = 0;
+    //the first pass warms up the caches and the buffers and isn't counted
+    for (uint iteration = 0; iteration <= iterations; ++iteration) {
+        double sums[numStages] = { 0 };
+        for (Entry& entry : entries) {
+            double seconds[numStages] = { 0 };
+            if (entry.failed || !timeStages(entry.data, *header, buffers, decoder, sink, numThreads, seconds)) {
+                entry.failed = true;
+                continue;
+            }
+            if (iteration == 0) {
+                entry.pixels = (uint64_t)header->width * header->height;
+                corpusPixels += entry.pixels;
+                continue;
+            }
+            for (uint i = 0; i < numStages; ++i) {
+                entry.timings[i].push_back(seconds[i]);
+                sums[i] += seconds[i];
+            }
         }
-        for (uint i = 0; i < paddingSize; ++i) {
-            outFile.put(0);
+        for (uint i = 0; i < numStages && iteration > 0; ++i) {
+            corpus[i].push_back(sums[i]);
         }
     }
 
-    outFile.close();
+    for (const Entry& entry : entries) {
+        if (entry.failed) {
+            std::cout << "{\"file\":" << jsonString(entry.filename) << ",\"error\":\"decode failed\"}\n";
+            continue;
+        }
+        printResults(std::cout, entry.filename, entry.pixels, iterations, entry.timings);
+    }
+    printResults(std::cout, "corpus", corpusPixels, iterations, corpus);
+    return 0;
 }
 
+#else
 
 int main (int argc, char** argv){
-    std::cout << "program running!\n";
     if (argc < 2) {
         std::cout<<"Error! invalid arguments\n";
         return 1;
     }
-    for (uint i=1; i < argc; ++i) {
+    setLogging(LogLevel::Info);
+    DecodeOptions options;
+    OutputFormat outputFormat = OutputFormat::BMP;
+    std::vector<Job> jobs;
+    bool batch = false;
+    bool quiet = false;
+    bool probe = false;
+    ParseDepth probeDepth = ParseDepth::FirstScan;
+    uint batchThreads = 0;
+    for (int i=1; i < argc; ++i) {
         const std::string filename(argv[i]);
-        std::cout<<"Filename = "<<filename<<"\n";
-        Header* header = readJPG(filename);
-
-        if (header == nullptr) {
+        //decoding options apply to the files after them
+        if (filename == "--fast-upsampling") {
+            options.upsampling = UpsamplingMode::Replicate;
             continue;
         }
-        if (header->valid == false) {
-            delete header;
+        if (filename == "--streaming") {
+            options.streaming = true;
             continue;
         }
-
-        printHeader(header);
-        
-        //huffman coded bitstream
-        MCU* mcus = decodeHuffmanData(header);
-        if(mcus == nullptr) {
-            delete header;
+        if (filename == "--pipelined") {
+            options.pipelined = true;
+            continue;
+        }
+        if (filename == "--scale" && i + 1 < argc) {
+            options.scale = std::atoi(argv[++i]);
+            continue;
+        }
+        //--crop x y width height, in pixels of the scaled image
+        if (filename == "--crop" && i + 4 < argc) {
+            options.cropX = std::atoi(argv[++i]);
+            options.cropY = std::atoi(argv[++i]);
+            options.cropWidth = std::atoi(argv[++i]);
+            options.cropHeight = std::atoi(argv[++i]);
+            continue;
+        }
+        //--format bmp|pnm|raw, raw is the interleaved pixels without a header
+        if (filename == "--format" && i + 1 < argc) {
+            const std::string name(argv[++i]);
+            if (name == "bmp") {
+                outputFormat = OutputFormat::BMP;
+            }
+            else if (name == "pnm") {
+                outputFormat = OutputFormat::PNM;
+            }
+            else if (name == "raw") {
+                outputFormat = OutputFormat::Raw;
+            }
+            else {
+                std::cout << "Error - Unknown output format: " << name << "\n";
+                return 1;
+            }
+            continue;
+        }
+        //--log-level none|error|info|debug, info is the default of the command line
+        if (filename == "--log-level" && i + 1 < argc) {
+            const std::string name(argv[++i]);
+            const LogLevel levels[] = { LogLevel::None, LogLevel::Error, LogLevel::Info, LogLevel::Debug };
+            const char* const names[] = { "none", "error", "info", "debug" };
+            bool found = false;
+            for (uint l = 0; l < 4; ++l) {
+                if (name == names[l]) {
+                    setLogging(levels[l]);
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::cout << "Error - Unknown log level: " << name << "\n";
+                return 1;
+            }
+            continue;
+        }
+        //--simd scalar|sse2|ssse3|avx2|avx512, the widest kernels the cpu has are the default
+        if (filename == "--simd" && i + 1 < argc) {
+            const std::string name(argv[++i]);
+            SIMDLevel level;
+            if (!parseSIMDLevel(name, level)) {
+                std::cout << "Error - Unknown SIMD level: " << name << "\n";
+                return 1;
+            }
+            setSIMDLevel(level);
+            continue;
+        }
+        //--probe prints what the headers say and decodes nothing, --probe-frame stops after the frame header
+        //so a prefix that ends before the first scan is enough
+        if (filename == "--probe" || filename == "--probe-frame") {
+            probe = true;
+            probeDepth = filename == "--probe" ? ParseDepth::FirstScan : ParseDepth::Frame;
             continue;
         }
+        //batch options apply to the whole run
+        if (filename == "--batch") {
+            batch = true;
+            continue;
+        }
+        if (filename == "--threads" && i + 1 < argc) {
+            batchThreads = std::atoi(argv[++i]);
+            continue;
+        }
+        if (filename == "--quiet") {
+            quiet = true;
+            continue;
+        }
+        std::error_code error;
+        if (std::filesystem::is_directory(filename, error)) {
+            listDirectory(filename, options, outputFormat, jobs);
+        }
+        else {
+            jobs.push_back({ filename, options, outputFormat });
+        }
+    }
+
+    if (probe) {
+        //the parser's own messages are dropped so there is one line per file
+        setLogging(LogLevel::None);
+        bool success = true;
+        for (const Job& job : jobs) {
+            ImageInfo info;
+            success = probeJPG(job.filename, info, probeDepth) && success;
+            printImageInfo(std::cout, job.filename, info);
+        }
+        return success ? 0 : 1;
+    }
 
-        //write bmp file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFileName = (pos == std::string::npos) ? (filename + ".bmp") : (filename.substr(0 , pos) + ".bmp");
-        writeBMP(header, mcus, outFileName);
+    if (batch) {
+        return runBatch(jobs, batchThreads, quiet);
+    }
 
-        delete[] mcus;
-        delete header;
+    JPG_LOG(LogLevel::Info, "program running!");
+    JPG_LOG(LogLevel::Info, "SIMD = " << simdLevelName(simdLevel()));
+    Decoder decoder;
+    for (const Job& job : jobs) {
+        JPG_LOG(LogLevel::Info, "Filename = " << job.filename);
+        uint64_t pixels = 0;
+        convertFile(decoder, job.filename, job.options, job.outputFormat, true, pixels);
     }
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
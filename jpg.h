@@ -1,10 +1,19 @@
 #ifndef JPG_H
 #define JPG_H
 #include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <string>
 
 typedef unsigned char byte;
 typedef unsigned int uint;
 
+class MappedFile;
+class WorkerPool;
+
 //Start of Frame markers, non-differential, Huffman coding
 const byte SOF0 = 0xC0; //baseline DCT
 const byte SOF1 = 0xC1; //extended sequential DCT
@@ -91,10 +100,26 @@ const byte JPG13 = 0xFD;
 const byte COM = 0xFE;
 const byte TEM = 0x01;
 
+//number of bits used to index the first-level huffman lookup tables
+const uint HUFFMAN_LOOKUP_BITS = 9;
+
 struct HuffmanTable {
     byte symbols[162] = {0};
     byte offsets[17] = {0};
     uint codes[162] = {0};
+
+    //first-level lookup indexed by the next HUFFMAN_LOOKUP_BITS bits of the stream
+    //high byte is the symbol, low byte is the code length (0 if the code is longer)
+    unsigned short lookup[1 << HUFFMAN_LOOKUP_BITS] = {0};
+
+    //AC run/size pairs whose code and magnitude bits both fit in the lookup bits
+    //bits 8-15 coefficient value, bits 4-7 zero run, bits 0-3 total bits used (0 if not available)
+    short acLookup[1 << HUFFMAN_LOOKUP_BITS] = {0};
+
+    //slow path for longer codes, indexed by code length
+    //maxCode is -1 if there are no codes of that length
+    int maxCode[17] = {0};
+    int valueOffset[17] = {0};
     bool set = false;
 };
 
@@ -112,8 +137,35 @@ struct QuantizationTable{
     uint table[64] = { 0 };   
 };
 
+//one SOS segment and the entropy-coded data that follows it
+//progressive images spread the coefficients over several scans and may redefine
+//huffman tables between them, so each scan keeps its own copy of the tables it uses
+struct Scan {
+    byte numComponents = 0;
+    //index into colorComponents of each component in the scan
+    byte componentIndices[3] = { 0 };
+    HuffmanTable dcHuffmanTables[3];
+    HuffmanTable acHuffmanTables[3];
+
+    byte startOfSelection = 0;
+    byte endOfSelection = 0;
+    byte successiveApproxHigh = 0;
+    byte successiveApproxLow = 0;
+
+    //byte stuffed huffman data, points into the input rather than holding a copy
+    const byte* huffmanData = nullptr;
+    std::size_t huffmanDataLength = 0;
+    uint restartInterval = 0;
+    //offsets into huffmanData of the first byte after each restart marker
+    std::vector<std::size_t> restartOffsets;
+};
+
 struct Header{
     bool valid = true;
+    //the data ended before parsing was done
+    bool truncated = false;
+    //the frame header was read whole and passed its checks, even if something after it failed
+    bool frameRead = false;
     bool zeroIndex = false;
     QuantizationTable quantizationTables[4];
     HuffmanTable dcHuffmanTables[4];
@@ -124,41 +176,275 @@ struct Header{
     uint width = 0;
     byte numComponents = 0;
 
-    byte startOfSelection = 0;
-    byte endOfSelection = 0;
-    byte successiveApproxHigh = 0;
-    byte successiveApproxLow = 0;
+    //MCU layout, an MCU covers 8*maxHorizontalSamplingFactor x 8*maxVerticalSamplingFactor pixels
+    byte maxHorizontalSamplingFactor = 1;
+    byte maxVerticalSamplingFactor = 1;
+    uint mcuWidth = 0;
+    uint mcuHeight = 0;
 
-    std::vector<byte> huffmanData;
     uint restartInterval = 0;
+    //every scan of the image in file order, baseline images usually have just one
+    std::vector<Scan> scans;
+
+    //keeps a memory-mapped input alive while the scans point into it
+    std::shared_ptr<MappedFile> file;
 
     ColorComponent colorComponents[3];
 
 };
 
-struct MCU {
-    union{
-        int y[64] = {0};
-        int r[64];
-    };
-    union{
-        int cb[64] = {0};
-        int g[64];
-    };
-    union{
-        int cr[64] = {0};
-        int b[64];
-    };
-    int* operator[] (uint i) {
-        switch(i) {
-            case 0 : return y;
-            case 1 : return cb;
-            case 2 : return cr;
-            default : return nullptr;
-        }
+//allocator for buffers the SIMD kernels work on, every allocation starts on a cache line
+template <typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+    static const std::size_t alignment = 64;
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(const std::size_t count) {
+        return (T*)::operator new(count * sizeof(T), std::align_val_t(alignment));
+    }
+    void deallocate(T* const pointer, const std::size_t) {
+        ::operator delete(pointer, std::align_val_t(alignment));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+//quantized DCT coefficients of one block in natural order, 16 bits hold any 8-bit precision coefficient
+//a block fills exactly two cache lines
+struct alignas(64) CoefficientBlock {
+    int16_t coefficients[64];
+};
+
+//quantized DCT coefficients of one component
+//blocks are stored row by row and cover whole MCUs
+//when streaming only blocksHigh rows starting at firstRow are held
+struct ComponentCoefficients {
+    std::vector<CoefficientBlock, AlignedAllocator<CoefficientBlock>> blocks;
+    //zigzag index of the last nonzero coefficient of each block, 0 when only the DC coefficient is set
+    std::vector<byte> lastIndices;
+    uint blocksWide = 0;
+    uint blocksHigh = 0;
+    uint firstRow = 0;
+
+    int16_t* block(const uint row, const uint column) {
+        return blocks[(std::size_t)(row - firstRow) * blocksWide + column].coefficients;
+    }
+    byte& lastIndex(const uint row, const uint column) {
+        return lastIndices[(std::size_t)(row - firstRow) * blocksWide + column];
+    }
+};
+
+//8-bit samples of one component after the inverse DCT
+//only the most recent rows are held, row y wraps around to y % rows
+//the stride is a multiple of 32 so every row starts aligned for the SIMD kernels
+struct ComponentPlane {
+    std::vector<byte, AlignedAllocator<byte>> samples;
+    uint stride = 0;
+    uint rows = 0;
+    //each block becomes blockSize x blockSize samples, less than 8 when decoding at a reduced scale
+    uint blockSize = 8;
+    //how many output pixels each sample covers in either direction
+    uint horizontalRatio = 1;
+    uint verticalRatio = 1;
+
+    byte* row(const uint y) {
+        return samples.data() + (std::size_t)(y % rows) * stride;
+    }
+    const byte* row(const uint y) const {
+        return samples.data() + (std::size_t)(y % rows) * stride;
+    }
+};
+
+//MCU rows in flight between the entropy decoding and the workers of a pipelined decode
+const uint PIPELINE_DEPTH = 8;
+
+//working memory of decodeImage. a Decoder keeps it between images, so one that is no larger
+//than any before it decodes without allocating
+struct DecodeBuffers {
+    ComponentCoefficients coefficients[3];
+    ComponentCoefficients pipeline[PIPELINE_DEPTH][3];
+    ComponentPlane planes[3];
+    //one row of output pixels and one upsampled row of each component
+    std::vector<byte, AlignedAllocator<byte>> pixels;
+    std::vector<byte, AlignedAllocator<byte>> upsampled[3];
+    //threads of the parallel parts of a decode, kept for the next one
+    std::shared_ptr<WorkerPool> workers;
+};
+
+//how subsampled chroma is brought back to full resolution
+//Replicate repeats each sample, Fancy interpolates with a triangle filter like the IJG library
+enum class UpsamplingMode {
+    Replicate,
+    Fancy
+};
+
+//how decodeImage gets from huffman data to pixels
+//streaming decodes single-scan sequential images one MCU row at a time so memory grows with the
+//width of the image only, otherwise all coefficients are decoded first with restart intervals in parallel
+struct DecodeOptions {
+    UpsamplingMode upsampling = UpsamplingMode::Fancy;
+    bool streaming = false;
+    //the output is 1/scale of the image size, one of 1, 2, 4 or 8
+    uint scale = 1;
+    //window of the scaled image to decode, a zero width or height decodes all of it
+    //only the MCUs under the window are transformed and converted
+    uint cropX = 0;
+    uint cropY = 0;
+    uint cropWidth = 0;
+    uint cropHeight = 0;
+    //0 uses one thread per hardware thread
+    uint numThreads = 0;
+    //single-scan images are entropy decoded on the calling thread while numThreads workers transform,
+    //convert and output the MCU rows it has finished, for large images without restart markers
+    bool pipelined = false;
+};
+
+//byte order of interleaved output pixels, the 4-byte formats have an opaque alpha
+//Gray is one byte of luma per pixel
+enum class PixelFormat {
+    RGB,
+    BGR,
+    RGBA,
+    BGRA,
+    Gray
+};
+
+//how far readJPG parses before it stops
+//Frame stops after the frame header, FirstScan at the first SOS before any huffman data is read,
+//Image reads every scan up to EOI
+enum class ParseDepth {
+    Frame,
+    FirstScan,
+    Image
+};
+
+//what a header-only probe learned about an image
+struct ImageInfo {
+    bool valid = false;
+    //the data ended before the probe reached the point it was asked to stop at
+    bool truncated = false;
+    //the frame header was read, so frameType up to the sampling factors are known even when valid is false
+    bool frameRead = false;
+    byte frameType = 0;
+    uint width = 0;
+    uint height = 0;
+    byte numComponents = 0;
+    byte horizontalSamplingFactors[3] = { 0 };
+    byte verticalSamplingFactors[3] = { 0 };
+    uint restartInterval = 0;
+    //which tables had been defined by the time the probe stopped
+    bool quantizationTables[4] = { false };
+    bool dcHuffmanTables[4] = { false };
+    bool acHuffmanTables[4] = { false };
+};
+
+//quantized DCT coefficients of one component, what's left after the entropy decoding
+//blocks cover the whole MCU grid in raster order, the ones past widthInBlocks x heightInBlocks are padding.
+//coefficients are in natural order, multiply by quantizationTable to dequantize them
+struct CoefficientPlane {
+    const CoefficientBlock* blocks = nullptr;
+    uint blocksWide = 0;
+    uint blocksHigh = 0;
+    uint widthInBlocks = 0;
+    uint heightInBlocks = 0;
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+    QuantizationTable quantizationTable;
+
+    const int16_t* block(const uint row, const uint column) const {
+        return blocks[(std::size_t)row * blocksWide + column].coefficients;
     }
 };
 
+//every component of an image decoded only as far as its coefficients
+//the blocks belong to the buffers they were decoded into and are only good until those are reused
+struct ImageCoefficients {
+    byte frameType = 0;
+    uint width = 0;
+    uint height = 0;
+    byte numComponents = 0;
+    byte maxHorizontalSamplingFactor = 1;
+    byte maxVerticalSamplingFactor = 1;
+    uint mcuWidth = 0;
+    uint mcuHeight = 0;
+    CoefficientPlane components[3];
+};
+
+//how much the decoder reports, every level includes the ones before it
+enum class LogLevel {
+    None,
+    Error,
+    Info,
+    Debug
+};
+
+//receives every message at or below the log level, without a trailing newline
+typedef std::function<void(LogLevel level, const std::string& message)> LogSink;
+
+//instruction sets in increasing order, AVX512 only tells that the cpu has it
+enum class SIMDLevel {
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    AVX512
+};
+
+//the kernels picked for the SIMD level, filled in once at startup
+struct Kernels {
+    SIMDLevel level = SIMDLevel::Scalar;
+    void (*idctBlock)(const int16_t* coefficients, const uint* quantizationTable, byte* output, uint stride, bool sparse) = nullptr;
+    void (*YCbCrToPixels)(const byte* y, const byte* cb, const byte* cr, byte* output, uint width, PixelFormat format) = nullptr;
+    void (*grayToPixels)(const byte* y, byte* output, uint width, PixelFormat format) = nullptr;
+};
+
+//what happened during one decode, only counted in builds with -DJPG_STATS and all zero otherwise
+struct DecodeStats {
+    uint64_t bitsConsumed = 0;
+    //0x00 bytes dropped after an 0xFF in the huffman data
+    uint64_t bytesUnstuffed = 0;
+    //huffman codes longer than the lookup tables, decoded bit length by bit length
+    uint64_t huffmanSlowPath = 0;
+    uint64_t restartIntervals = 0;
+    //blocks through the inverse DCT, the ones with only a DC coefficient
+    //and the ones with only their top left 4x4 coefficients set
+    uint64_t blocks = 0;
+    uint64_t dcOnlyBlocks = 0;
+    uint64_t sparseBlocks = 0;
+    //wall clock time of each stage
+    double parseSeconds = 0;
+    double entropySeconds = 0;
+    double idctSeconds = 0;
+    double colorSeconds = 0;
+    double outputSeconds = 0;
+};
+
+//receives row y of the decoded image as width pixels of the requested format
+//rows come top to bottom, returning false stops decoding
+typedef std::function<bool(uint y, const byte* pixels)> ScanlineCallback;
+
+//destination of a decoded image, fed one contiguous row of pixels at a time, top to bottom
+class OutputSink {
+    public:
+        virtual ~OutputSink() {}
+        //the pixel format the sink wants for an image with numComponents components
+        virtual PixelFormat format(const byte numComponents) const = 0;
+        //called once before the first row with the size of the output
+        virtual bool begin(const uint width, const uint height, const PixelFormat format) = 0;
+        //row y as width pixels of the format passed to begin
+        virtual bool writeRow(const uint y, const byte* const pixels) = 0;
+        //called after the last row of a successful decode, false when the output couldn't be completed.
+        //it isn't called when the decode fails, a sink that writes a file should remove it in that case
+        virtual bool finish() = 0;
+};
+
 const byte zigzagMap[] = {
     0,   1,  8, 16,  9,  2, 3, 10,
     17, 24, 32, 25, 18, 11, 4,  5,